@@ -0,0 +1,192 @@
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <cstring>
+
+#include "benchmark.hpp"
+
+DECLARE_int32(symbol_size);
+DECLARE_int32(encoders);
+DECLARE_double(ack_timeout);
+DECLARE_double(req_timeout);
+DECLARE_int32(bench_size);
+DECLARE_int32(bench_count);
+DECLARE_int32(bench_rate);
+DECLARE_int32(bench_erasure);
+DECLARE_double(bench_timeout);
+
+/* frames in flight between the two instances */
+#define BENCH_INBOX_SIZE 4096
+
+#define BENCH_UNSET UINT64_MAX
+
+benchmark::benchmark(counters_base::pointer counts)
+    : m_ingress(FLAGS_bench_count),
+      m_latency(FLAGS_bench_count, BENCH_UNSET)
+{
+    counters_group("bench");
+    counters(counts);
+
+    m_src = io::pointer(new io);
+    m_dst = io::pointer(new io);
+    m_src_link = loopback::pointer(new loopback(FLAGS_bench_erasure,
+                                                BENCH_INBOX_SIZE));
+    m_dst_link = loopback::pointer(new loopback(FLAGS_bench_erasure,
+                                                BENCH_INBOX_SIZE));
+    loopback::connect(m_src_link, m_dst_link);
+    m_dst_link->set_sink(std::bind(&benchmark::sink, this,
+                                   std::placeholders::_1,
+                                   std::placeholders::_2));
+    m_src->set_backend(m_src_link);
+    m_dst->set_backend(m_dst_link);
+
+    m_ack_tracker.reset(new ctrl_tracker(FLAGS_ack_timeout*1000));
+    m_req_tracker.reset(new ctrl_tracker(FLAGS_req_timeout*1000));
+
+    m_enc_map = encoder_map::pointer(new encoder_map);
+    m_enc_map->set_io(m_src);
+    m_enc_map->counters(counts);
+    m_enc_map->init(FLAGS_encoders);
+    m_src->set_encoder_map(m_enc_map);
+
+    m_dec_map = decoder_map::pointer(new decoder_map);
+    m_dec_map->set_io(m_dst);
+    m_dec_map->counters(counts);
+    m_dec_map->ctrl_trackers(ctrl_tracker_api::ACK, m_ack_tracker);
+    m_dec_map->ctrl_trackers(ctrl_tracker_api::REQ, m_req_tracker);
+    m_dst->set_decoder_map(m_dec_map);
+
+    for (auto i : {m_src, m_dst}) {
+        i->counters(counts);
+        i->pool()->counters(counts);
+        i->loop()->counters(counts);
+        i->netlink_open();
+        i->netlink_register();
+        i->start();
+    }
+}
+
+benchmark::~benchmark()
+{
+    m_src->stop();
+    m_dst->stop();
+    m_enc_map.reset();
+    m_dec_map.reset();
+}
+
+/* Called by the writer of the decoding instance */
+void benchmark::sink(const uint8_t *data, size_t len)
+{
+    clock::time_point now = clock::now();
+    uint32_t index;
+
+    if (len < sizeof(index))
+        return;
+
+    memcpy(&index, data, sizeof(index));
+
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    if (index >= m_latency.size() || m_latency[index] != BENCH_UNSET)
+        return;
+
+    m_latency[index] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now - m_ingress[index]).count();
+    m_last = now;
+    m_received++;
+    m_cond.notify_all();
+}
+
+void benchmark::run(const std::atomic<bool> &running)
+{
+    size_t size = std::max<size_t>(FLAGS_bench_size, sizeof(uint32_t));
+    std::vector<uint8_t> data(size);
+    clock::duration interval(0);
+    clock::time_point next;
+    uint32_t index;
+
+    /* the encoder keeps two bytes of each symbol for the length */
+    CHECK_LE(size + sizeof(uint16_t), FLAGS_symbol_size)
+        << "bench: Frames must fit in a symbol";
+
+    if (FLAGS_bench_rate > 0)
+        interval = std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double>(1.0 / FLAGS_bench_rate));
+
+    LOG(INFO) << "bench: " << m_ingress.size() << " frames of " << size
+              << " bytes";
+
+    m_first = next = clock::now();
+
+    for (index = 0; index < m_ingress.size() && running; ++index) {
+        if (interval.count()) {
+            std::this_thread::sleep_until(next);
+            next += interval;
+        }
+
+        memcpy(&data[0], &index, sizeof(index));
+        m_ingress[index] = clock::now();
+
+        /* the encoders are full; the offered rate is more than we do */
+        while (!m_src_link->inject(&data[0], size) && running) {
+            m_blocked++;
+            std::this_thread::yield();
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_sent = index;
+    m_cond.wait_for(lock, std::chrono::duration<double>(FLAGS_bench_timeout),
+                    [this]() { return m_received >= m_sent; });
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+
+    return sorted[std::min<size_t>(sorted.size() * p, sorted.size() - 1)];
+}
+
+void benchmark::report()
+{
+    std::vector<uint64_t> sorted;
+    double secs, pps, mbps, p50, p99, p999;
+    size_t size = std::max<size_t>(FLAGS_bench_size, sizeof(uint32_t));
+
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    for (auto l : m_latency)
+        if (l != BENCH_UNSET)
+            sorted.push_back(l);
+
+    std::sort(sorted.begin(), sorted.end());
+
+    secs = std::chrono::duration<double>(m_last - m_first).count();
+    pps = secs > 0 ? m_received / secs : 0;
+    mbps = pps * size * 8 / 1e6;
+    p50 = percentile(sorted, .5) / 1000;
+    p99 = percentile(sorted, .99) / 1000;
+    p999 = percentile(sorted, .999) / 1000;
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "frames: " << m_received << "/" << m_sent
+              << " (blocked " << m_blocked << ")" << std::endl
+              << "throughput: " << pps << " frames/s, " << mbps << " Mbit/s"
+              << std::endl
+              << "latency p50: " << p50 << " us, p99: " << p99
+              << " us, p999: " << p999 << " us" << std::endl;
+
+    counters_set("frames", m_received);
+    counters_set("lost", m_sent - m_received);
+    counters_set("blocked", m_blocked);
+    counters_set("frames/s", pps);
+    counters_set("kbit/s", mbps * 1000);
+    counters_set("p50 us", p50);
+    counters_set("p99 us", p99);
+    counters_set("p999 us", p999);
+}
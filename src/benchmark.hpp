@@ -0,0 +1,46 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <vector>
+
+#include "io.hpp"
+#include "loopback.hpp"
+#include "encoder_map.hpp"
+#include "decoder_map.hpp"
+#include "ctrl_tracker.hpp"
+#include "counters.hpp"
+
+/* Runs frames through a full encoder and decoder pipeline in one process,
+ * two io instances connected by loopback backends, and measures the time
+ * from injecting each plain frame until it comes out decoded. Frames carry
+ * their index in the first four bytes to find their ingress time.
+ */
+class benchmark : public counters_api
+{
+    typedef std::chrono::steady_clock clock;
+
+    io::pointer m_src, m_dst;
+    loopback::pointer m_src_link, m_dst_link;
+    encoder_map::pointer m_enc_map;
+    decoder_map::pointer m_dec_map;
+    ctrl_tracker::pointer m_ack_tracker, m_req_tracker;
+
+    std::vector<clock::time_point> m_ingress;
+    std::vector<uint64_t> m_latency;
+    clock::time_point m_first, m_last;
+    size_t m_sent = {0}, m_received = {0}, m_blocked = {0};
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+
+    void sink(const uint8_t *data, size_t len);
+
+  public:
+    benchmark(counters_base::pointer counts);
+    ~benchmark();
+
+    void run(const std::atomic<bool> &running);
+    void report();
+};
@@ -59,6 +59,18 @@ class counters_base {
         (*m_counter_map)[shm_string(key.c_str(), m_allocator)]++;
     }
 
+    void add(const std::string &key, size_t val)
+    {
+        std::lock_guard<std::mutex> l(m_lock);
+        (*m_counter_map)[shm_string(key.c_str(), m_allocator)] += val;
+    }
+
+    void set(const std::string &key, size_t val)
+    {
+        std::lock_guard<std::mutex> l(m_lock);
+        (*m_counter_map)[shm_string(key.c_str(), m_allocator)] = val;
+    }
+
     void print()
     {
         std::lock_guard<std::mutex> l(m_lock);
@@ -84,6 +96,18 @@ class counters_api
             m_counts->increment(m_group + " " + str);
     }
 
+    void counters_add(const char *str, size_t val)
+    {
+        if (m_counts)
+            m_counts->add(m_group + " " + str, val);
+    }
+
+    void counters_set(const char *str, size_t val)
+    {
+        if (m_counts)
+            m_counts->set(m_group + " " + str, val);
+    }
+
   public:
     void counters(counters_base::pointer counts)
     {
@@ -6,14 +6,19 @@
 #include <mutex>
 #include <vector>
 #include <chrono>
+#include <algorithm>
 
 #include "logging.hpp"
 
+/* shortest REQ/ACK timeout in milliseconds, as the round trip estimate
+ * divided over many waiting coders quickly rounds down to nothing
+ */
+#define CTRL_TIMEOUT_MIN 50
+
 class ctrl_tracker
 {
-    size_t m_count = {0};
+    std::atomic<size_t> m_count = {0}, m_avg;
     std::pair<size_t, size_t> m_rtt;
-    size_t m_avg;
     std::mutex m_lock;
 
   public:
@@ -24,17 +29,15 @@ class ctrl_tracker
 
     void wait()
     {
-        std::lock_guard<std::mutex> lock(m_lock);
-        m_count++;
-        VLOG(LOG_CTRL) << "count++ = " << m_count;
+        size_t count = ++m_count;
+        VLOG(LOG_CTRL) << "count++ = " << count;
     }
 
     void done()
     {
-        std::lock_guard<std::mutex> lock(m_lock);
-        m_count--;
-        CHECK_GE(m_count, 0) << "negative count";
-        VLOG(LOG_CTRL) << "count-- = " << m_count;
+        size_t count = m_count--;
+        CHECK_GT(count, 0) << "negative count";
+        VLOG(LOG_CTRL) << "count-- = " << count - 1;
     }
 
     size_t waiting()
@@ -139,13 +142,14 @@ class ctrl_tracker_api
         return m_trackers[t] ? m_trackers[t]->waiting() : 0;
     }
 
+    /* only reads atomic counters, as every timer restart asks for it */
     size_t timeout(TYPE t)
     {
-        std::lock_guard<std::mutex> lock(m_locks[t]);
         size_t blocked = 1;
 
-        for (auto i : m_trackers)
-            blocked += i->waiting();
+        for (auto &i : m_trackers)
+            if (i)
+                blocked += i->waiting();
 
         return m_trackers[t]->get_rtt()/blocked;
     }
@@ -183,12 +187,12 @@ class ctrl_tracker_api
 
     size_t ack_timeout()
     {
-        return timeout(ACK)*2;
+        return std::max<size_t>(timeout(ACK)*2, CTRL_TIMEOUT_MIN);
     }
 
     size_t req_timeout()
     {
-        return timeout(REQ)*2;
+        return std::max<size_t>(timeout(REQ)*2, CTRL_TIMEOUT_MIN);
     }
 
   public:
@@ -10,12 +10,58 @@ decoder::~decoder()
 {
     m_running = false;
 
-    m_queue_lock.lock();
-    m_queue_cond.notify_all();
-    m_queue_lock.unlock();
+    if (m_wheel) {
+        m_wheel->cancel(m_ctrl_timer);
+        m_wheel->cancel(m_gen_timer);
+    }
+
+    if (m_loop)
+        m_loop->remove(m_event);
 
-    if (m_thread.joinable())
-        m_thread.join();
+    free_queue();
+}
+
+/* Build the messages sent for this generation once; they only differ in
+ * the decoded payload, or the rank and sequence number of requests
+ */
+void decoder::build_templates()
+{
+    struct nl_msg *msg;
+
+    msg = CHECK_NOTNULL(alloc_msg());
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_FRAME, 1));
+    CHECK_EQ(nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_io->ifindex()), 0);
+    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, DEC_PACKET), 0);
+    m_dec_template.capture(msg);
+    m_msg_cache.release(msg);
+
+    msg = CHECK_NOTNULL(alloc_msg());
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_FRAME, 1));
+    CHECK_EQ(nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_io->ifindex()), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, m_src), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, m_dst), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_BLOCK, uid()), 0);
+    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, ACK_PACKET), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_INT, 0), 0);
+    m_ack_template.capture(msg);
+    m_msg_cache.release(msg);
+
+    msg = CHECK_NOTNULL(alloc_msg());
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_FRAME, 1));
+    CHECK_EQ(nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_io->ifindex()), 0);
+    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, REQ_PACKET), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, m_src), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, m_dst), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_BLOCK, uid()), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_RANK, 0), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_SEQ, 0), 0);
+    m_req_template.capture(msg);
+    m_req_rank_offset = m_req_template.offset(BATADV_HLP_A_RANK);
+    m_req_seq_offset = m_req_template.offset(BATADV_HLP_A_SEQ);
+    m_msg_cache.release(msg);
 }
 
 void decoder::send_dec(size_t index)
@@ -38,18 +84,17 @@ void decoder::send_dec(size_t index)
     LOG_IF(FATAL, len > 1600) << "failed packet (block: " << block()
                                           << ", index: " << index << ")";
 
-    msg = CHECK_NOTNULL(nlmsg_alloc());
-    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->family(),
-                              0, 0, BATADV_HLP_C_FRAME, 1));
+    if (m_dec_template.empty())
+        build_templates();
 
-    CHECK_EQ(nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_io->ifindex()), 0);
-    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, DEC_PACKET), 0);
+    msg = CHECK_NOTNULL(alloc_msg());
+    m_dec_template.stamp(msg);
     CHECK_EQ(nla_put(msg, BATADV_HLP_A_FRAME, len, buf + sizeof(uint16_t)), 0);
 
     if (m_io)
         m_io->add_msg(DEC_PACKET, msg);
     else
-        nlmsg_free(msg);
+        m_msg_cache.release(msg);
 
     VLOG(LOG_PKT) << "decoded (block: " << block()
                   << ", index: " << index << ")";
@@ -57,27 +102,20 @@ void decoder::send_dec(size_t index)
     counters_increment("dec");
 }
 
-void decoder::process_enc(struct nl_msg *msg, struct nlattr **attrs)
+void decoder::process_enc(const struct frame &f)
 {
     size_t rank = this->rank(), size = this->payload_size(), index;
     bool systematic;
-    struct nlattr *attr;
-    uint8_t *data;
-    uint16_t len;
 
     if (this->is_complete())
         return;
 
     if (this->rank() == 0)
-        read_address(attrs);
+        read_address(f);
 
-    /* get data from netlink message */
-    attr = attrs[BATADV_HLP_A_FRAME];
-    data = static_cast<uint8_t *>(nla_data(attr));
-    len = nla_len(attr);
-    CHECK_EQ(len, size) << "invalid length";
+    CHECK_EQ(f.len, size) << "invalid length";
 
-    this->decode(data);
+    this->decode(f.data);
 
     if (this->rank() == rank) {
         counters_increment("non-innovative");
@@ -103,19 +141,13 @@ void decoder::process_enc(struct nl_msg *msg, struct nlattr **attrs)
     m_decoded = false;
 }
 
-void decoder::process_msg(struct nl_msg *msg)
+void decoder::process_msg(const struct frame &f)
 {
-    struct nlmsghdr *nlh = nlmsg_hdr(msg);
-    struct genlmsghdr *gnlh = (struct genlmsghdr *)nlmsg_data(nlh);
-    struct nlattr *attrs[BATADV_HLP_A_NUM], *attr;
-    size_t type;
+    size_t type = f.type;
 
-    genlmsg_parse(nlh, 0, attrs, BATADV_HLP_A_MAX, NULL);
-
-    type = nla_get_u8(attrs[BATADV_HLP_A_TYPE]);
     switch (type) {
         case ENC_PACKET:
-            process_enc(msg, attrs);
+            process_enc(f);
             counters_increment("enc");
             break;
 
@@ -123,48 +155,47 @@ void decoder::process_msg(struct nl_msg *msg)
             LOG(ERROR) << "encoder received unknown type: " << type;
             break;
     }
-
-    m_timestamp = timer::now();
 }
 
-void decoder::process_queue()
+/* Take everything queued at once and decode it without holding the lock
+ * the io reader needs to queue more; returns true if any frames were
+ * processed
+ */
+bool decoder::process_queue()
 {
-    struct nl_msg *msg;
+    struct frame f;
 
-    while (m_running) {
-        {
-            std::lock_guard<std::mutex> lock(m_queue_lock);
+    {
+        std::lock_guard<std::mutex> lock(m_queue_lock);
+        m_msg_queue.swap(m_msg_batch);
+    }
 
-            if (m_msg_queue.empty())
-                break;
+    if (m_msg_batch.empty())
+        return false;
 
-            msg = m_msg_queue.top();
-            m_msg_queue.pop();
-        }
+    while (m_running && !m_msg_batch.empty()) {
+        f = m_msg_batch.top();
+        m_msg_batch.pop();
 
-        process_msg(msg);
+        process_msg(f);
 
-        if (m_io)
-            m_io->free_msg(msg);
-        else
-            nlmsg_free(msg);
+        free_msg(f.msg);
     }
+
+    free_batch();
+
+    return true;
 }
 
 void decoder::send_ack()
 {
     struct nl_msg *msg;
 
-    msg = CHECK_NOTNULL(nlmsg_alloc());
-    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->family(),
-                              0, 0, BATADV_HLP_C_FRAME, 1));
+    if (m_dec_template.empty())
+        build_templates();
 
-    CHECK_EQ(nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_io->ifindex()), 0);
-    CHECK_EQ(nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, m_src), 0);
-    CHECK_EQ(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, m_dst), 0);
-    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_BLOCK, uid()), 0);
-    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, ACK_PACKET), 0);
-    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_INT, 0), 0);
+    msg = CHECK_NOTNULL(alloc_msg());
+    m_ack_template.stamp(msg);
 
     VLOG(LOG_CTRL) << "ack (block: " << block() << ")";
     m_io->add_msg(REQ_PACKET, msg);
@@ -175,17 +206,13 @@ void decoder::send_req()
 {
     struct nl_msg *msg;
 
-    msg = CHECK_NOTNULL(nlmsg_alloc());
-    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->family(),
-                              0, 0, BATADV_HLP_C_FRAME, 1));
+    if (m_dec_template.empty())
+        build_templates();
 
-    CHECK_EQ(nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_io->ifindex()), 0);
-    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, REQ_PACKET), 0);
-    CHECK_EQ(nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, m_src), 0);
-    CHECK_EQ(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, m_dst), 0);
-    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_BLOCK, uid()), 0);
-    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_RANK, this->rank()), 0);
-    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_SEQ, m_req_seq), 0);
+    msg = CHECK_NOTNULL(alloc_msg());
+    m_req_template.stamp(msg);
+    msg_template::patch<uint16_t>(msg, m_req_rank_offset, this->rank());
+    msg_template::patch<uint16_t>(msg, m_req_seq_offset, m_req_seq);
 
     VLOG(LOG_CTRL) << "req (block: " << block()
                    << ", rank: " << this->rank()
@@ -211,6 +238,8 @@ void decoder::process_decoder()
         for (size_t i = 0; i < this->symbols(); ++i)
             send_dec(i);
 
+        /* everything is sent, so the symbols are not read again */
+        m_symbol_storage.discard();
         return;
     }
 
@@ -224,88 +253,168 @@ void decoder::process_decoder()
     }
 }
 
+/* Retransmit REQs or ACKs when the wheel says so; the generation timer
+ * keeps running from the last received frame, so a peer that never answers
+ * does not keep the decoder alive
+ */
 void decoder::process_timer()
 {
     double budget = source_budget(1, ONE, ONE, FLAGS_e3*2.55);
-    resolution diff;
-    size_t req_to = req_timeout(), ack_to = ack_timeout();
+    size_t timeout;
 
-    diff = std::chrono::duration_cast<resolution>(timer::now() - m_timestamp);
+    if (m_gen_timer.expired()) {
+        go_idle();
+        return;
+    }
+
+    if (!m_ctrl_timer.expired())
+        return;
+
+    if (!this->is_partial_complete()) {
+        timeout = req_timeout();
 
-    if (diff.count() >= req_to && !this->is_partial_complete()) {
         for (; budget >= 1; --budget)
             send_req();
 
         req_wait();
         m_req_seq++;
-        m_timestamp = timer::now();
-        m_timeout -= req_to;
-        return;
-    } else if (diff.count() >= ack_to && this->is_partial_complete()) {
+    } else {
+        timeout = ack_timeout();
+
         for (; budget >= 1; --budget)
             send_ack();
-        m_timestamp = timer::now();
-        m_timeout -= ack_to;
+
         ack_wait();
-        return;
     }
 
-    if (diff.count() >= m_timeout) {
-        ack_done();
-        m_idle = true;
+    m_wheel->add(m_ctrl_timer, resolution(timeout));
+}
+
+void decoder::go_idle()
+{
+    ack_done();
+    m_idle = true;
+    m_wheel->cancel(m_ctrl_timer);
+    m_wheel->cancel(m_gen_timer);
+    m_symbol_storage.discard();
+    free_queue();
+}
+
+void decoder::free_batch()
+{
+    while (m_msg_batch.size()) {
+        free_msg(m_msg_batch.top().msg);
+        m_msg_batch.pop();
     }
 }
 
 void decoder::free_queue()
 {
-    struct nl_msg *msg;
-    std::lock_guard<std::mutex> lock(m_queue_lock);
-
-    while (m_msg_queue.size()) {
-        msg = m_msg_queue.top();
-        if (m_io)
-            m_io->free_msg(msg);
-        else
-            nlmsg_free(msg);
-        m_msg_queue.pop();
+    free_batch();
+
+    {
+        std::lock_guard<std::mutex> lock(m_queue_lock);
+        m_msg_queue.swap(m_msg_batch);
     }
+
+    free_batch();
+}
+
+/* Restart the REQ/ACK and generation timers after activity */
+void decoder::schedule()
+{
+    size_t timeout;
+
+    if (!m_wheel || m_idle)
+        return;
+
+    timeout = this->is_partial_complete() ? ack_timeout() : req_timeout();
+    m_wheel->add(m_ctrl_timer, resolution(timeout));
+    m_wheel->add(m_gen_timer, resolution(m_timeout));
 }
 
-void decoder::thread_func()
+/* Runs on the reactor when frames are queued or a timer expires */
+void decoder::process()
 {
-    std::chrono::milliseconds interval(50);
+    bool active, idle;
+    uint16_t id;
 
-    while (m_running) {
-        std::unique_lock<std::mutex> lock(m_queue_lock);
-        m_queue_cond.wait_for(lock, interval);
-        lock.unlock();
+    {
+        std::lock_guard<std::mutex> lock(m_init_lock);
 
         if (m_idle)
-            continue;
+            return;
 
-        m_init_lock.lock();
-        process_queue();
+        active = process_queue();
         process_decoder();
+
+        if (active)
+            schedule();
+
         process_timer();
-        m_init_lock.unlock();
+        idle = m_idle;
+        id = uid();
     }
 
-    free_queue();
+    /* unlocked, as the map may hand this decoder out again right away */
+    if (idle && m_on_idle)
+        m_on_idle(id);
+}
+
+void decoder::set_io(io::pointer io)
+{
+    size_t grp;
+
+    io_base::set_io(io);
+
+    /* coders are recycled by the factory, so only register once */
+    if (m_loop || !io)
+        return;
+
+    m_loop = io->loop();
+    m_wheel = io->wheel();
+    grp = m_loop->coder_group();
+    m_event = m_loop->add_event(std::bind(&decoder::process, this), grp);
+    m_symbol_storage.bind(m_loop->node(grp));
+    m_ctrl_timer.set_callback(std::bind(&reactor::notify, m_loop.get(),
+                                        m_event));
+    m_gen_timer.set_callback(std::bind(&reactor::notify, m_loop.get(),
+                                       m_event));
+    schedule();
 }
 
-void decoder::add_msg(size_t type, struct nl_msg *msg)
+void decoder::add_msg(size_t type, const struct frame &f)
 {
-    nlmsg_get(msg);
-    m_msg_queue.push(type, msg);
-    m_queue_cond.notify_one();
+    std::unique_lock<std::mutex> lock(m_queue_lock, std::defer_lock);
+    uint64_t stall = lock_stalled(lock);
+    bool first = false, idle = m_idle;
+
+    /* frames racing with retirement are not kept until the next reuse */
+    if (!idle) {
+        m_msg_queue.push(type, f);
+        first = m_msg_queue.size() == 1;
+    }
+
+    lock.unlock();
+
+    if (idle)
+        free_msg(f.msg);
+
+    /* a non-empty queue has already been notified and is drained fully */
+    if (m_loop && first)
+        m_loop->notify(m_event);
+
+    if (stall) {
+        counters_increment("inbox stalls");
+        counters_add("inbox stall ns", stall);
+    }
 }
 
-void decoder::add_enc(struct nl_msg *msg)
+void decoder::add_enc(const struct frame &f)
 {
-    std::lock_guard<std::mutex> lock(m_queue_lock);
     m_enc_count++;
     req_done();
-    add_msg(ENC_PACKET, msg);
+    add_msg(ENC_PACKET, f);
 }
 
 };  // namespace kodo
@@ -2,19 +2,21 @@
 
 #include <kodo/rlnc/full_vector_codes.hpp>
 #include <kodo/is_partial_complete.hpp>
+#include <kodo/shallow_symbol_storage.hpp>
 #include "kodo/rank_info.hpp"
 #include "kodo/payload_rank_decoder.hpp"
 #include <atomic>
-#include <thread>
 #include <mutex>
-#include <condition_variable>
 #include <vector>
+#include <functional>
 
 #include "io.hpp"
 #include "counters.hpp"
 #include "queue.hpp"
 #include "ctrl_tracker.hpp"
 #include "systematic_decoder.hpp"
+#include "msg_template.hpp"
+#include "symbol_storage.hpp"
 
 DECLARE_double(decoder_timeout);
 
@@ -43,7 +45,7 @@ class decoder_base
              coefficient_storage<
              coefficient_info<
              // Storage API
-             deep_symbol_storage<
+             mutable_shallow_symbol_storage<
              storage_bytes_used<
              storage_block_info<
              // Finite Field API
@@ -62,51 +64,61 @@ class decoder
     public ctrl_tracker_api,
     public decoder_base<fifi::binary8>
 {
-    typedef std::chrono::high_resolution_clock timer;
-    typedef timer::time_point timestamp;
+  public:
+    typedef std::function<void(uint16_t)> idle_callback;
+
+  private:
     typedef std::chrono::milliseconds resolution;
     typedef std::chrono::duration<resolution> duration;
 
-    prio_queue<struct nl_msg *> m_msg_queue;
-    timestamp m_timestamp;
-    std::thread m_thread;
+    prio_queue<struct frame> m_msg_queue, m_msg_batch;
+    reactor::pointer m_loop;
+    timer_wheel::pointer m_wheel;
+    timer_wheel::entry m_ctrl_timer, m_gen_timer;
+    idle_callback m_on_idle;
+    int m_event = {-1};
     std::mutex m_queue_lock, m_init_lock;
-    std::condition_variable m_queue_cond;
     std::atomic<uint8_t> m_block, m_dec_id;
     std::atomic<size_t> m_enc_count;
     std::atomic<bool> m_running = {true}, m_decoded, m_idle;
     std::vector<bool> m_decoded_symbols;
+    symbol_storage m_symbol_storage;
     uint8_t m_src[ETH_ALEN], m_dst[ETH_ALEN];
     size_t m_req_seq, m_timeout, m_req_timeout, m_ack_timeout;
+    msg_template m_dec_template, m_ack_template, m_req_template;
+    size_t m_req_rank_offset, m_req_seq_offset;
 
+    void build_templates();
     void send_dec(size_t index);
     void send_ack();
     void send_req();
-    void process_enc(struct nl_msg *msg, struct nlattr **attrs);
-    void process_msg(struct nl_msg *msg);
-    void process_queue();
+    void process_enc(const struct frame &f);
+    void process_msg(const struct frame &f);
+    bool process_queue();
     void process_decoder();
     void process_timer();
+    void go_idle();
+    void free_batch();
     void free_queue();
-    void thread_func();
-    void add_msg(size_t type, struct nl_msg *msg);
+    void schedule();
+    void process();
+    void add_msg(size_t type, const struct frame &f);
 
-    void read_address(struct nlattr **attrs)
+    void read_address(const struct frame &f)
     {
-        void *src = nla_data(attrs[BATADV_HLP_A_SRC]);
-        void *dst = nla_data(attrs[BATADV_HLP_A_DST]);
-
-        memcpy(m_src, src, ETH_ALEN);
-        memcpy(m_dst, dst, ETH_ALEN);
+        memcpy(m_src, f.src, ETH_ALEN);
+        memcpy(m_dst, f.dst, ETH_ALEN);
+        m_dec_template.clear();
     }
 
   public:
-    decoder() : m_msg_queue(PACKET_NUM, NULL)
+    decoder() : m_msg_queue(PACKET_NUM), m_msg_batch(PACKET_NUM)
     {
         counters_group("decoder");
     }
     ~decoder();
-    void add_enc(struct nl_msg *msg);
+    void add_enc(const struct frame &f);
+    void set_io(io::pointer io);
 
     template<class Factory>
     void construct(Factory &factory)
@@ -114,7 +126,8 @@ class decoder
         std::lock_guard<std::mutex> lock(m_init_lock);
         decoder_base::construct(factory);
         m_decoded_symbols.resize(factory.max_symbols());
-        m_thread = std::thread(std::bind(&decoder::thread_func, this));
+        m_symbol_storage.alloc(factory.max_symbols() *
+                               factory.max_symbol_size());
     }
 
     template<class Factory>
@@ -122,6 +135,9 @@ class decoder
     {
         std::lock_guard<std::mutex> lock(m_init_lock);
         decoder_base::initialize(factory);
+        this->set_symbols(sak::mutable_storage(m_symbol_storage.data(),
+                                               this->symbols() *
+                                               this->symbol_size()));
         counters_increment("generations");
         ack_done();
 
@@ -129,10 +145,17 @@ class decoder
         m_idle = false;
         m_req_seq = 1;
         m_enc_count = 0;
-        m_timestamp = timer::now();
         m_timeout = FLAGS_decoder_timeout*1000;
+        m_dec_template.clear();
         std::fill(m_decoded_symbols.begin(), m_decoded_symbols.end(), false);
         free_queue();
+        schedule();
+    }
+
+    /* called with the uid of the generation once it went idle */
+    void on_idle(idle_callback cb)
+    {
+        m_on_idle = cb;
     }
 
     void dec_id(uint8_t id)
@@ -6,41 +6,65 @@ decoder::pointer decoder_map::create_decoder(uint8_t id, uint8_t block)
     decoder::pointer dec = m_factory.build();
     dec->dec_id(id);
     dec->block(block);
-    dec->set_io(m_io);
     dec->counters(counters());
     dec->ctrl_trackers(ctrl_trackers());
+    dec->set_io(m_io);
+    dec->on_idle(std::bind(&decoder_map::retire, this, std::placeholders::_1));
 
     return dec;
 }
 
 decoder::pointer decoder_map::get_decoder(uint8_t id, uint8_t block)
 {
-    if (m_decoders.size() < id + 1) {
+    if (m_decoders.size() < id + 1u) {
         m_decoders.resize(id + 1);
-        m_decoders[id] = create_decoder(id, block);
-        return m_decoders[id];
+        m_tombstones.resize(id + 1);
+        m_tombstoned.resize(id + 1, false);
     }
 
-    if (!m_decoders[id]) {
-        m_decoders[id] = create_decoder(id, block);
+    if (m_decoders[id] && m_decoders[id]->block() == block)
         return m_decoders[id];
-    }
 
-    if (m_decoders[id]->block() == block)
-        return m_decoders[id];
+    if (m_decoders[id] && m_decoders[id]->block() > block && block != 0)
+        return decoder::pointer();
 
-    if (m_decoders[id]->block() > block && block != 0)
+    /* late frames for a retired generation only cost a compare */
+    if (!m_decoders[id] && m_tombstoned[id] &&
+        (m_tombstones[id] == block ||
+         (m_tombstones[id] > block && block != 0))) {
+        counters_increment("tombstone drop");
         return decoder::pointer();
+    }
 
     m_decoders[id] = decoder::pointer();
+    m_tombstoned[id] = false;
     m_decoders[id] = create_decoder(id, block);
 
     return m_decoders[id];
 }
 
-void decoder_map::add_enc(struct nl_msg *msg, struct nlattr **attrs)
+/* Hand an idle decoder back to the factory and remember its block */
+void decoder_map::retire(uint16_t uid)
+{
+    uint8_t id = uid_dec(uid);
+
+    std::lock_guard<std::mutex> lock(m_decoders_lock);
+
+    if (id >= m_decoders.size() || !m_decoders[id] ||
+        m_decoders[id]->uid() != uid)
+        return;
+
+    VLOG(LOG_GEN) << "retire (block: " << static_cast<int>(uid_block(uid))
+                  << ")";
+    m_tombstones[id] = uid_block(uid);
+    m_tombstoned[id] = true;
+    m_decoders[id] = decoder::pointer();
+    counters_increment("retired");
+}
+
+void decoder_map::add_enc(const struct frame &f)
 {
-    uint16_t uid = nla_get_u16(attrs[BATADV_HLP_A_BLOCK]);
+    uint16_t uid = f.uid;
     uint8_t dec_id = uid_dec(uid);
     uint8_t block = uid_block(uid);
     decoder::pointer dec;
@@ -51,9 +75,10 @@ void decoder_map::add_enc(struct nl_msg *msg, struct nlattr **attrs)
     if (!dec) {
         VLOG(LOG_PKT) << "dropping enc (block: " << static_cast<int>(block)
                       << ")";
+        free_msg(f.msg);
         return;
     }
 
     VLOG(LOG_PKT) << "add enc (block: " << static_cast<int>(block) << ")";
-    dec->add_enc(msg);
+    dec->add_enc(f);
 }
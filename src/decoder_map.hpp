@@ -17,11 +17,14 @@ DECLARE_int32(symbols);
 class decoder_map : public io_base, public counters_api, public ctrl_tracker_api
 {
     std::vector<decoder::pointer> m_decoders;
+    std::vector<uint8_t> m_tombstones;
+    std::vector<bool> m_tombstoned;
     std::mutex m_decoders_lock;
     decoder::factory m_factory;
 
     decoder::pointer create_decoder(uint8_t id, uint8_t block);
     decoder::pointer get_decoder(uint8_t id, uint8_t block);
+    void retire(uint16_t uid);
 
     uint8_t uid_dec(uint16_t uid) const
     {
@@ -37,6 +40,14 @@ class decoder_map : public io_base, public counters_api, public ctrl_tracker_api
     typedef std::shared_ptr<decoder_map> pointer;
 
     decoder_map() : m_factory(FLAGS_symbols, FLAGS_symbol_size)
-    {}
-    void add_enc(struct nl_msg *msg, struct nlattr **attrs);
+    {
+        counters_group("decoder");
+    }
+    void add_enc(const struct frame &f);
+
+    /* length of the coded frames the decoders take */
+    size_t payload_size()
+    {
+        return m_factory.max_payload_size();
+    }
 };
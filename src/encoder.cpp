@@ -1,5 +1,6 @@
 #include <netlink/genl/genl.h>
 #include <chrono>
+#include <cstdint>
 
 #include "encoder.hpp"
 #include "io-api.hpp"
@@ -8,47 +9,47 @@ DECLARE_double(encoder_timeout);
 
 namespace kodo {
 
-void encoder::free_queue()
+void encoder::free_batch()
 {
-    struct nl_msg *msg;
-    std::lock_guard<std::mutex> lock(m_queue_lock);
-
-    while (m_msg_queue.size()) {
-        msg = m_msg_queue.top();
-        if (m_io)
-            m_io->free_msg(msg);
-        else
-            nlmsg_free(msg);
-        m_msg_queue.pop();
+    while (m_msg_batch.size()) {
+        free_msg(m_msg_batch.top().msg);
+        m_msg_batch.pop();
         counters_increment("free");
     }
 }
 
+void encoder::free_queue()
+{
+    free_batch();
+
+    {
+        std::lock_guard<std::mutex> lock(m_queue_lock);
+        m_msg_queue.swap(m_msg_batch);
+    }
+
+    free_batch();
+}
+
 encoder::~encoder()
 {
     m_running = false;
 
-    m_queue_lock.lock();
-    m_queue_cond.notify_all();
-    m_queue_lock.unlock();
+    if (m_wheel) {
+        m_wheel->cancel(m_retry_timer);
+        m_wheel->cancel(m_gen_timer);
+    }
 
-    if (m_thread.joinable())
-        m_thread.join();
+    if (m_loop)
+        m_loop->remove(m_event);
 
-    if (m_symbol_storage)
-        delete[] m_symbol_storage;
+    free_queue();
 }
 
-void encoder::send_encoded()
+/* Everything but the coded payload is the same for the whole generation */
+void encoder::build_template()
 {
-    struct nl_msg *msg;
-    struct nlattr *attr;
-    uint8_t *data;
+    struct nl_msg *msg = CHECK_NOTNULL(alloc_msg());
 
-    if (!m_io)
-        return;
-
-    msg = CHECK_NOTNULL(nlmsg_alloc());
     CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->family(),
                               0, 0, BATADV_HLP_C_FRAME, 1));
 
@@ -57,6 +58,25 @@ void encoder::send_encoded()
     CHECK_EQ(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, m_dst), 0);
     CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_BLOCK, uid()), 0);
     CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, ENC_PACKET), 0);
+
+    m_enc_template.capture(msg);
+    m_msg_cache.release(msg);
+}
+
+void encoder::send_encoded()
+{
+    struct nl_msg *msg;
+    struct nlattr *attr;
+    uint8_t *data;
+
+    if (!m_io)
+        return;
+
+    if (m_enc_template.empty())
+        build_template();
+
+    msg = CHECK_NOTNULL(alloc_msg());
+    m_enc_template.stamp(msg);
     attr = CHECK_NOTNULL(nla_reserve(msg, BATADV_HLP_A_FRAME,
                                      this->payload_size()));
     data = reinterpret_cast<uint8_t *>(nla_data(attr));
@@ -68,24 +88,17 @@ void encoder::send_encoded()
     counters_increment("enc");
 }
 
-void encoder::process_plain(struct nl_msg *msg, struct nlattr **attrs)
+void encoder::process_plain(const struct frame &f)
 {
-    struct nlattr *attr;
-    uint8_t *data, *buf;
-    uint16_t len;
-
-    /* get data from netlink message */
-    attr = attrs[BATADV_HLP_A_FRAME];
-    data = static_cast<uint8_t *>(nla_data(attr));
-    len = nla_len(attr);
+    uint8_t *buf;
 
     if (this->rank() == 0)
-        read_address(attrs);
+        read_address(f);
 
     /* set length and add data to encoder */
     buf = get_symbol_buffer(this->rank());
-    *reinterpret_cast<uint16_t *>(buf) = len;
-    memcpy(buf + sizeof(len), data, len);
+    *reinterpret_cast<uint16_t *>(buf) = f.len;
+    memcpy(buf + sizeof(f.len), f.data, f.len);
     sak::mutable_storage symbol(buf, this->symbol_size());
     this->set_symbol(this->rank(), symbol);
 
@@ -96,15 +109,9 @@ void encoder::process_plain(struct nl_msg *msg, struct nlattr **attrs)
                   << ", credits: " << m_credits << ")";
 }
 
-void encoder::process_req(struct nl_msg *msg, struct nlattr **attrs)
+void encoder::process_req(const struct frame &f)
 {
-    struct nlattr *attr;
-    size_t rank, seq;
-
-    attr = attrs[BATADV_HLP_A_RANK];
-    rank = nla_get_u16(attr);
-    attr = attrs[BATADV_HLP_A_SEQ];
-    seq  = nla_get_u16(attr);
+    size_t rank = f.rank, seq = f.seq;
 
     if (rank == this->rank() || seq == m_last_req_seq) {
         VLOG(LOG_CTRL) << "dropping request (block: " << block()
@@ -127,24 +134,18 @@ void encoder::process_req(struct nl_msg *msg, struct nlattr **attrs)
     m_last_req_seq = seq;
 }
 
-void encoder::process_msg(struct nl_msg *msg)
+void encoder::process_msg(const struct frame &f)
 {
-    struct nlmsghdr *nlh = nlmsg_hdr(msg);
-    struct genlmsghdr *gnlh = (struct genlmsghdr *)nlmsg_data(nlh);
-    struct nlattr *attrs[BATADV_HLP_A_NUM], *attr;
-    size_t type;
+    size_t type = f.type;
 
-    genlmsg_parse(nlh, 0, attrs, BATADV_HLP_A_MAX, NULL);
-
-    type = nla_get_u8(attrs[BATADV_HLP_A_TYPE]);
     switch (type) {
         case PLAIN_PACKET:
-            process_plain(msg, attrs);
+            process_plain(f);
             counters_increment("plain");
             break;
 
         case REQ_PACKET:
-            process_req(msg, attrs);
+            process_req(f);
             counters_increment("req");
             break;
 
@@ -152,73 +153,148 @@ void encoder::process_msg(struct nl_msg *msg)
             LOG(ERROR) << "encoder received unknown type: " << type;
             break;
     }
-
-    m_timestamp = timer::now();
 }
 
-void encoder::process_queue()
+/* Take everything queued at once and process it without holding the
+ * lock the io reader needs to queue more; returns true if any frames were
+ * processed
+ */
+bool encoder::process_queue()
 {
-    struct nl_msg *msg;
+    struct frame f;
 
-    while (m_running) {
+    {
         std::lock_guard<std::mutex> lock(m_queue_lock);
+        m_msg_queue.swap(m_msg_batch);
+    }
 
-        if (m_msg_queue.empty())
-            break;
+    if (m_msg_batch.empty())
+        return false;
 
-        msg = m_msg_queue.top();
-        m_msg_queue.pop();
+    while (m_running && !m_msg_batch.empty()) {
+        f = m_msg_batch.top();
+        m_msg_batch.pop();
 
-        process_msg(msg);
+        process_msg(f);
 
-        if (m_io)
-            m_io->free_msg(msg);
-        else
-            nlmsg_free(msg);
+        free_msg(f.msg);
     }
+
+    free_batch();
+
+    return true;
 }
 
 void encoder::process_encoder()
 {
-    while (m_running && m_credits >= 1)
+    size_t burst = SIZE_MAX;
+
+    /* while io is congested, credits are kept but spent one per round */
+    if (m_io && m_io->congested()) {
+        burst = 1;
+        counters_increment("throttled");
+    }
+
+    for (size_t i = 0; m_running && m_credits >= 1 && i < burst; ++i)
         send_encoded();
 
     if (this->rank() != this->symbols())
         return;
 
-    while (m_running && m_enc_count < m_budget)
+    for (size_t i = 0; m_running && m_enc_count < m_budget && i < burst; ++i)
         send_encoded();
 }
 
-void encoder::thread_func()
+/* Restart the generation timeout after activity */
+void encoder::schedule()
+{
+    auto timeout = std::chrono::duration<double>(FLAGS_encoder_timeout);
+
+    if (m_wheel)
+        m_wheel->add(m_gen_timer,
+                     std::chrono::duration_cast<timer_wheel::clock::duration>(
+                             timeout));
+}
+
+/* Runs on the reactor when frames are queued or a timer expires */
+void encoder::process()
 {
-    std::chrono::milliseconds interval(50);
+    bool expired;
+    uint16_t id;
+
+    {
+        std::lock_guard<std::mutex> lock(m_init_lock);
+
+        if (process_queue())
+            schedule();
 
-    while (m_running) {
-        m_init_lock.lock();
-        process_queue();
         process_encoder();
-        m_init_lock.unlock();
 
-        std::unique_lock<std::mutex> lock(m_queue_lock);
-        m_queue_cond.wait_for(lock, interval);
+        /* credits left over by throttling are spent on the next round */
+        if (m_running && (m_credits >= 1 ||
+                          (this->rank() == this->symbols() &&
+                           m_enc_count < m_budget)))
+            m_wheel->add(m_retry_timer, std::chrono::milliseconds(1));
+
+        expired = m_gen_timer.expired();
+        id = uid();
     }
 
-    free_queue();
+    /* unlocked, as the map may hand this encoder out again right away */
+    if (expired && m_running && m_expire) {
+        VLOG(LOG_GEN) << "expired (block: " << block() << ")";
+        counters_increment("expired");
+        m_expire(id);
+    }
+}
+
+void encoder::set_io(io::pointer io)
+{
+    size_t grp;
+
+    io_base::set_io(io);
+
+    /* coders are recycled by the factory, so only register once */
+    if (m_loop || !io)
+        return;
+
+    m_loop = io->loop();
+    m_wheel = io->wheel();
+    grp = m_loop->coder_group();
+    m_event = m_loop->add_event(std::bind(&encoder::process, this), grp);
+    m_symbol_storage.bind(m_loop->node(grp));
+    m_retry_timer.set_callback(std::bind(&reactor::notify, m_loop.get(),
+                                         m_event));
+    m_gen_timer.set_callback(std::bind(&reactor::notify, m_loop.get(),
+                                       m_event));
+    schedule();
+    m_loop->notify(m_event);
 }
 
-void encoder::add_msg(uint8_t type, struct nl_msg *msg)
+void encoder::add_msg(uint8_t type, const struct frame &f)
 {
-    nlmsg_get(msg);
-    m_msg_queue.push(type, msg);
-    m_queue_cond.notify_one();
+    std::unique_lock<std::mutex> lock(m_queue_lock, std::defer_lock);
+    uint64_t stall = lock_stalled(lock);
+    bool first;
+
+    m_msg_queue.push(type, f);
+    first = m_msg_queue.size() == 1;
+    lock.unlock();
+
+    /* a non-empty queue has already been notified and is drained fully */
+    if (m_loop && first)
+        m_loop->notify(m_event);
+
+    if (stall) {
+        counters_increment("inbox stalls");
+        counters_add("inbox stall ns", stall);
+    }
 }
 
-void encoder::add_plain(struct nl_msg *msg)
+void encoder::add_plain(const struct frame &f)
 {
-    std::lock_guard<std::mutex> lock(m_queue_lock);
     m_plain_count++;
-    add_msg(PLAIN_PACKET, msg);
+    add_msg(PLAIN_PACKET, f);
 }
 
 };  // namepace kodo
@@ -7,11 +7,10 @@
 #include "kodo/rank_info.hpp"
 #include "kodo/payload_rank_encoder.hpp"
 
-#include <thread>
 #include <mutex>
-#include <condition_variable>
 #include <atomic>
 #include <chrono>
+#include <functional>
 
 #include "logging.hpp"
 #include "counters.hpp"
@@ -19,6 +18,8 @@
 #include "queue.hpp"
 #include "io-api.hpp"
 #include "io.hpp"
+#include "msg_template.hpp"
+#include "symbol_storage.hpp"
 
 DECLARE_int32(e1);
 DECLARE_int32(e2);
@@ -68,51 +69,55 @@ class encoder
     public counters_api,
     public encoder_base<fifi::binary8>
 {
-    typedef std::chrono::high_resolution_clock timer;
-    typedef timer::time_point timestamp;
-    typedef std::chrono::milliseconds resolution;
-    typedef std::chrono::duration<resolution> duration;
-
-    prio_queue<struct nl_msg *> m_msg_queue;
-    std::thread m_thread;
+  public:
+    typedef std::function<void(uint16_t)> expire_callback;
+
+  private:
+    prio_queue<struct frame> m_msg_queue, m_msg_batch;
+    reactor::pointer m_loop;
+    timer_wheel::pointer m_wheel;
+    timer_wheel::entry m_retry_timer, m_gen_timer;
+    expire_callback m_expire;
+    int m_event = {-1};
     std::mutex m_queue_lock, m_init_lock;
-    std::condition_variable m_queue_cond;
-    timestamp m_timestamp = {timer::now()};
     std::atomic<bool> m_running = {true};
     std::atomic<size_t> m_plain_count = {0}, m_enc_count = {0};
     std::atomic<size_t> m_last_req_seq = {0};
     std::atomic<uint8_t> m_e1, m_e2, m_e3;
     double m_credits = {0}, m_budget = {0};
-    uint8_t *m_symbol_storage, m_src[ETH_ALEN], m_dst[ETH_ALEN];
+    symbol_storage m_symbol_storage;
+    uint8_t m_src[ETH_ALEN], m_dst[ETH_ALEN];
     uint8_t m_block, m_encoder;
+    msg_template m_enc_template;
 
+    void free_batch();
     void free_queue();
+    void build_template();
     void send_encoded();
-    void process_plain(struct nl_msg *msg, struct nlattr **attrs);
-    void process_req(struct nl_msg *msg, struct nlattr **attrs);
-    void process_msg(struct nl_msg *msg);
-    void process_queue();
+    void process_plain(const struct frame &f);
+    void process_req(const struct frame &f);
+    void process_msg(const struct frame &f);
+    bool process_queue();
     void process_encoder();
-    void thread_func();
-    void add_msg(uint8_t type, struct nl_msg *msg);
+    void process();
+    void schedule();
+    void add_msg(uint8_t type, const struct frame &f);
 
     uint8_t *get_symbol_buffer(size_t i)
     {
-        return m_symbol_storage + i * this->symbol_size();
+        return m_symbol_storage.data() + i * this->symbol_size();
     }
 
-    void read_address(struct nlattr **attrs)
+    void read_address(const struct frame &f)
     {
-        void *src = nla_data(attrs[BATADV_HLP_A_SRC]);
-        void *dst = nla_data(attrs[BATADV_HLP_A_DST]);
-
-        memcpy(m_src, src, ETH_ALEN);
-        memcpy(m_dst, dst, ETH_ALEN);
+        memcpy(m_src, f.src, ETH_ALEN);
+        memcpy(m_dst, f.dst, ETH_ALEN);
+        m_enc_template.clear();
         counters_increment("generations");
     }
 
   public:
-    encoder() : m_msg_queue(PACKET_NUM, NULL)
+    encoder() : m_msg_queue(PACKET_NUM), m_msg_batch(PACKET_NUM)
     {
         m_e1 = FLAGS_e1*2.55;
         m_e2 = FLAGS_e2*2.55;
@@ -121,7 +126,8 @@ class encoder
     }
 
     ~encoder();
-    void add_plain(struct nl_msg *msg);
+    void add_plain(const struct frame &f);
+    void set_io(io::pointer io);
 
     template<class Factory>
     void construct(Factory &factory)
@@ -130,8 +136,7 @@ class encoder
 
         std::lock_guard<std::mutex> lock(m_init_lock);
         encoder_base::construct(factory);
-        m_symbol_storage = CHECK_NOTNULL(new uint8_t[data_size]);
-        m_thread = std::thread(std::bind(&encoder::thread_func, this));
+        m_symbol_storage.alloc(data_size);
 
         LOG(INFO) << "constructed new encoder";
     }
@@ -143,12 +148,13 @@ class encoder
         encoder_base::initialize(factory);
 
         m_budget = source_budget(this->symbols(), m_e1, m_e2, m_e3);
-        m_timestamp = timer::now();
         m_last_req_seq = 0;
         m_plain_count = 0;
         m_enc_count = 0;
         m_credits = 0;
+        m_enc_template.clear();
         free_queue();
+        schedule();
 
         VLOG(LOG_GEN) << "init (block: " << block()
                       << ", budget: " << m_budget << ")";
@@ -189,10 +195,15 @@ class encoder
         m_encoder = enc;
     }
 
-    void add_req(struct nl_msg *msg)
+    /* called with the uid of the generation once it timed out */
+    void on_expire(expire_callback cb)
+    {
+        m_expire = cb;
+    }
+
+    void add_req(const struct frame &f)
     {
-        std::lock_guard<std::mutex> lock(m_queue_lock);
-        add_msg(REQ_PACKET, msg);
+        add_msg(REQ_PACKET, f);
     }
 };
 
@@ -1,27 +1,60 @@
 #include <chrono>
 #include <algorithm>
+#include <functional>
 
 #include "logging.hpp"
 #include "io.hpp"
 #include "encoder_map.hpp"
 
+encoder_map::~encoder_map()
+{
+    for (auto &f : m_stage)
+        free_msg(f.msg);
+}
+
 void encoder_map::init(size_t encoder_num)
 {
-    std::lock_guard<std::mutex> lock(m_encoders_lock);
+    size_t shard_num = FLAGS_encoder_shards;
+    shard *s;
+
+    CHECK(FLAGS_stage_drop == "tail" || FLAGS_stage_drop == "head")
+        << "encoder map: Unknown staging drop policy " << FLAGS_stage_drop;
+    m_stage_head_drop = FLAGS_stage_drop == "head";
+    m_stage_depth = std::max(FLAGS_stage_depth, 0);
+    m_stage_high = m_stage_depth * std::min(std::max(FLAGS_stage_high, 0),
+                                            100) / 100;
+
+    /* zero means one shard per coder thread */
+    if (!shard_num)
+        shard_num = m_io ? m_io->loop()->coder_threads() : 1;
+
+    /* each shard needs at least one encoder of its own */
+    shard_num = std::max<size_t>(1, std::min(shard_num, encoder_num));
 
-    VLOG(LOG_INIT) << "using " << encoder_num << " encoders";
+    VLOG(LOG_INIT) << "using " << encoder_num << " encoders in "
+                   << shard_num << " shards";
     m_encoders.resize(encoder_num);
+    m_encoder_shard.resize(encoder_num);
 
-    for (size_t i = 0; i < encoder_num; ++i)
-        m_free_encoders.push_back(i);
+    for (size_t i = 0; i < shard_num; ++i) {
+        s = new shard;
+        m_shards.push_back(std::unique_ptr<shard>(s));
 
-    next_encoder();
+        for (size_t id = i*encoder_num/shard_num;
+             id < (i + 1)*encoder_num/shard_num; ++id) {
+            s->free_encoders.push_back(id);
+            m_encoder_shard[id] = i;
+        }
+
+        std::lock_guard<std::mutex> lock(s->lock);
+        next_encoder(*s);
+    }
 }
 
 void encoder_map::signal_blocking(bool enable)
 {
-    struct nl_msg *msg = nlmsg_alloc();
     uint32_t type = enable ? BATADV_HLP_C_BLOCK : BATADV_HLP_C_UNBLOCK;
+    struct nl_msg *msg;
 
     if (!m_io)
         return;
@@ -30,6 +63,7 @@ void encoder_map::signal_blocking(bool enable)
         return;
 
     VLOG(LOG_CTRL) << "signal blocking (" << enable << ")";
+    msg = CHECK_NOTNULL(alloc_msg());
     genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, m_io->family(), 0, 0,
                 type, 1);
     nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_io->ifindex());
@@ -37,70 +71,249 @@ void encoder_map::signal_blocking(bool enable)
     m_blocked = enable;
 }
 
-encoder::pointer encoder_map::current_encoder()
+/* Block the kernel when all shards are out of encoders and the staging
+ * buffer is past its high watermark, or when io is congested
+ */
+void encoder_map::update_blocking()
+{
+    std::lock_guard<std::mutex> lock(m_block_lock);
+    bool full = m_exhausted == m_shards.size() && m_staged >= m_stage_high;
+
+    signal_blocking(full || m_backpressure);
+}
+
+encoder::pointer encoder_map::current_encoder(shard &s)
 {
-    if (m_blocked)
+    if (s.exhausted)
         return encoder::pointer();
 
-    return m_encoders[m_current_encoder];
+    return m_encoders[s.current_encoder];
 }
 
-void encoder_map::next_encoder()
+void encoder_map::next_encoder(shard &s)
 {
     encoder::pointer enc;
+    uint8_t id;
+
+    if (s.free_encoders.empty()) {
+        if (!s.exhausted) {
+            s.exhausted = true;
+            m_exhausted++;
+        }
 
-    if (m_free_encoders.empty()) {
-        signal_blocking(true);
+        update_blocking();
         return;
     }
 
-    m_current_encoder = m_free_encoders.front();
-    m_free_encoders.pop_front();
-    m_encoders[m_current_encoder] = encoder::pointer();
-    m_encoders[m_current_encoder] = m_factory.build();
-    m_encoders[m_current_encoder]->block(m_block_count++);
-    m_encoders[m_current_encoder]->enc_id(m_current_encoder);
-    m_encoders[m_current_encoder]->set_io(m_io);
-    m_encoders[m_current_encoder]->counters(counters());
+    if (s.exhausted) {
+        s.exhausted = false;
+        m_exhausted--;
+    }
+
+    id = s.free_encoders.front();
+    s.free_encoders.pop_front();
+    s.current_encoder = id;
+
+    enc = s.factory.build();
+    enc->block(s.block_count++);
+    enc->enc_id(id);
+    enc->set_io(m_io);
+    enc->counters(counters());
+    enc->on_expire(std::bind(&encoder_map::expire, this,
+                             std::placeholders::_1));
+    m_encoders[id] = enc;
 }
 
-void encoder_map::free_encoder(uint8_t id)
+void encoder_map::free_encoder(shard &s, uint8_t id)
 {
-    m_free_encoders.push_back(id);
+    s.free_encoders.push_back(id);
     m_encoders[id] = encoder::pointer();
 
-    if (!m_blocked)
+    if (!s.exhausted)
         return;
 
-    next_encoder();
-    signal_blocking(false);
+    next_encoder(s);
+    feed(s);
+    update_blocking();
 }
 
-void encoder_map::add_plain(struct nl_msg *msg, struct nlattr **attrs)
+/* The shard owning the encoder id in uid, if the id is valid */
+encoder_map::shard *encoder_map::find_shard(uint16_t uid)
 {
-    encoder::pointer enc;
+    uint8_t enc_id = uid_enc(uid);
+
+    if (enc_id >= m_encoders.size())
+        return NULL;
+
+    return m_shards[m_encoder_shard[enc_id]].get();
+}
+
+/* Hold a plain frame while every encoder is busy, dropping the new or the
+ * oldest frame when the buffer is full
+ */
+void encoder_map::stage(const struct frame &in)
+{
+    struct frame drop, f = in;
+    bool dropped = true;
+
+    /* staged frames may wait for long, so they must not pin backend memory
+     * like the packet ring blocks
+     */
+    if (m_stage_depth && m_io)
+        f = m_io->detach_frame(in);
+
+    {
+        std::lock_guard<std::mutex> lock(m_stage_lock);
+
+        if (m_stage.size() < m_stage_depth) {
+            m_stage.push_back(f);
+            dropped = false;
+        } else if (m_stage_head_drop && m_stage_depth) {
+            drop = m_stage.front();
+            m_stage.pop_front();
+            m_stage.push_back(f);
+        } else {
+            drop = f;
+        }
+
+        m_staged = m_stage.size();
+    }
 
-    std::lock_guard<std::mutex> lock(m_encoders_lock);
-    enc = current_encoder();
-    if (!enc) {
+    if (dropped) {
         counters_increment("drop");
         VLOG(LOG_PKT) << "drop packet";
+        free_msg(drop.msg);
+    } else {
+        counters_increment("staged");
+    }
+
+    counters_set("stage occupancy", m_staged);
+
+    if (m_staged >= m_stage_high)
+        update_blocking();
+}
+
+bool encoder_map::unstage(struct frame &f)
+{
+    std::lock_guard<std::mutex> lock(m_stage_lock);
+
+    if (m_stage.empty())
+        return false;
+
+    f = m_stage.front();
+    m_stage.pop_front();
+    m_staged = m_stage.size();
+
+    return true;
+}
+
+/* Move staged frames into the encoders of s; called with s locked */
+void encoder_map::feed(shard &s)
+{
+    encoder::pointer enc;
+    struct frame f;
+    bool fed = false;
+
+    while (m_staged && (enc = current_encoder(s)) && unstage(f)) {
+        enc->add_plain(f);
+        fed = true;
+
+        if (enc->full())
+            next_encoder(s);
+    }
+
+    if (fed)
+        counters_set("stage occupancy", m_staged);
+}
+
+/* Feed staged frames to any shard that got an encoder meanwhile */
+void encoder_map::drain()
+{
+    for (auto &s : m_shards) {
+        if (!m_staged)
+            break;
+
+        std::lock_guard<std::mutex> lock(s->lock);
+        feed(*s);
+    }
+}
+
+/* Give up on a generation that got neither frames nor an ack in time */
+void encoder_map::expire(uint16_t uid)
+{
+    uint8_t enc_id = uid_enc(uid);
+    shard *s = find_shard(uid);
+    encoder::pointer enc;
+    bool current;
+
+    if (!s)
+        return;
+
+    std::lock_guard<std::mutex> lock(s->lock);
+    enc = m_encoders[enc_id];
+
+    if (!enc || enc->uid() != uid)
+        return;
+
+    enc = encoder::pointer();
+    current = !s->exhausted && enc_id == s->current_encoder;
+    free_encoder(*s, enc_id);
+
+    /* plain frames keep coming for the current one, so replace it */
+    if (current)
+        next_encoder(*s);
+}
+
+void encoder_map::add_plain(const struct frame &f)
+{
+    size_t num = m_shards.size();
+    size_t first = num > 1 ? f.flow(FLAGS_shard_tuple) % num : 0;
+    encoder::pointer enc;
+
+    /* queue behind frames already staged to keep them in order */
+    if (m_staged) {
+        stage(f);
+        drain();
         return;
     }
 
-    enc->add_plain(msg);
+    /* a shard out of encoders hands the frame on to the next one with an
+     * encoder, so frames are only staged once all of them are out
+     */
+    for (size_t i = 0; i < num; ++i) {
+        shard &s = *m_shards[(first + i) % num];
+        std::lock_guard<std::mutex> lock(s.lock);
+
+        enc = current_encoder(s);
+        if (!enc)
+            continue;
+
+        if (i)
+            counters_increment("shard spill");
+
+        enc->add_plain(f);
+
+        if (enc->full())
+            next_encoder(s);
+
+        return;
+    }
 
-    if (enc->full())
-        next_encoder();
+    stage(f);
+    drain();
 }
 
-void encoder_map::add_ack(struct nl_msg *msg, struct nlattr **attrs)
+void encoder_map::add_ack(const struct frame &f)
 {
-    uint16_t uid = nla_get_u16(attrs[BATADV_HLP_A_BLOCK]);
+    uint16_t uid = f.uid;
     uint8_t enc_id = uid_enc(uid);
+    shard *s = find_shard(uid);
     encoder::pointer enc;
 
-    std::lock_guard<std::mutex> lock(m_encoders_lock);
+    if (!s)
+        return;
+
+    std::lock_guard<std::mutex> lock(s->lock);
     enc = m_encoders[enc_id];
 
     if (!enc || enc->uid() != uid)
@@ -111,20 +324,38 @@ void encoder_map::add_ack(struct nl_msg *msg, struct nlattr **attrs)
                    << ", pkts: " << enc->enc_packets() << ")";
     counters_increment("ack");
     enc = encoder::pointer();
-    free_encoder(enc_id);
+    free_encoder(*s, enc_id);
 }
 
-void encoder_map::add_req(struct nl_msg *msg, struct nlattr **attrs)
+void encoder_map::add_req(const struct frame &f)
 {
-    uint16_t uid = nla_get_u16(attrs[BATADV_HLP_A_BLOCK]);
+    uint16_t uid = f.uid;
     uint8_t enc_id = uid_enc(uid);
+    shard *s = find_shard(uid);
     encoder::pointer enc;
 
-    std::lock_guard<std::mutex> lock(m_encoders_lock);
+    if (!s) {
+        free_msg(f.msg);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(s->lock);
     enc = m_encoders[enc_id];
 
-    if (!enc || enc->uid() != uid)
+    if (!enc || enc->uid() != uid) {
+        free_msg(f.msg);
         return;
+    }
+
+    enc->add_req(f);
+}
+
+void encoder_map::backpressure(bool enable)
+{
+    VLOG(LOG_CTRL) << "backpressure (" << enable << ")";
+    m_backpressure = enable;
+    update_blocking();
 
-    enc->add_req(msg);
+    if (enable)
+        counters_increment("backpressure");
 }
@@ -17,23 +17,60 @@
 
 DECLARE_int32(symbol_size);
 DECLARE_int32(symbols);
+DECLARE_int32(encoder_shards);
+DECLARE_bool(shard_tuple);
+DECLARE_int32(stage_depth);
+DECLARE_int32(stage_high);
+DECLARE_string(stage_drop);
 
 using kodo::encoder;
 
+/* Plain frames are spread over shards by the hash of their flow. Each shard
+ * owns a range of the encoder ids and has its own lock, free list, current
+ * encoder and block numbers, so frames of different flows are queued and
+ * encoded in parallel, and the frames of one flow stay in the same
+ * generations.
+ *
+ * While every shard is out of encoders, plain frames wait in a bounded
+ * staging buffer and go to the first encoder freed by an ack or a timeout,
+ * so a short burst is not lost. The kernel is only blocked once the buffer
+ * fills past its high watermark.
+ */
 class encoder_map : public io_base, public counters_api
 {
-    encoder::factory m_factory;
+    struct shard
+    {
+        encoder::factory factory;
+        std::deque<uint8_t> free_encoders;
+        std::mutex lock;
+        uint8_t block_count = {0}, current_encoder = {0};
+        bool exhausted = {false};
+
+        shard() : factory(FLAGS_symbols, FLAGS_symbol_size)
+        {}
+    };
+
+    std::vector<std::unique_ptr<shard>> m_shards;
     std::vector<encoder::pointer> m_encoders;
-    std::deque<uint8_t> m_free_encoders;
-    std::mutex m_encoders_lock;
-    std::atomic<uint8_t> m_block_count = {0}, m_current_encoder = {0};
-    std::atomic<bool> m_blocked = {false};
-
-    encoder::pointer create_encoder(uint8_t id);
-    encoder::pointer current_encoder();
-    void next_encoder();
-    void free_encoder(uint8_t id);
+    std::vector<uint8_t> m_encoder_shard;
+    std::deque<struct frame> m_stage;
+    std::mutex m_block_lock, m_stage_lock;
+    std::atomic<size_t> m_exhausted = {0}, m_staged = {0};
+    size_t m_stage_depth = {0}, m_stage_high = {0};
+    bool m_stage_head_drop = {false};
+    std::atomic<bool> m_blocked = {false}, m_backpressure = {false};
+
+    encoder::pointer current_encoder(shard &s);
+    void next_encoder(shard &s);
+    void free_encoder(shard &s, uint8_t id);
+    shard *find_shard(uint16_t uid);
+    void stage(const struct frame &f);
+    bool unstage(struct frame &f);
+    void feed(shard &s);
+    void drain();
+    void expire(uint16_t uid);
     void signal_blocking(bool enable);
+    void update_blocking();
 
     uint8_t uid_block(uint16_t uid)
     {
@@ -48,12 +85,19 @@ class encoder_map : public io_base, public counters_api
   public:
     typedef std::shared_ptr<encoder_map> pointer;
 
-    encoder_map() : m_factory(FLAGS_symbols, FLAGS_symbol_size)
+    encoder_map()
     {
         counters_group("encoder");
     }
-    void add_plain(struct nl_msg *msg, struct nlattr **attrs);
-    void add_ack(struct nl_msg *msg, struct nlattr **attrs);
-    void add_req(struct nl_msg *msg, struct nlattr **attrs);
+    ~encoder_map();
+    void add_plain(const struct frame &f);
+    void add_ack(const struct frame &f);
+    void add_req(const struct frame &f);
+    void backpressure(bool enable);
     void init(size_t encoder_num);
+
+    size_t shards() const
+    {
+        return m_shards.size();
+    }
 };
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <netlink/netlink.h>
+#include <netlink/attr.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <cstdint>
+
+#include "io-api.hpp"
+
+/* Descriptor of a received frame. The io reader walks the attribute table
+ * once and stores what the maps and coders need, so the coder threads never
+ * parse the message again. Pointers refer into msg, which travels with the
+ * descriptor and is released by whoever ends up owning the frame.
+ */
+struct frame
+{
+    struct nl_msg *msg = {NULL};
+    uint8_t type = {PACKET_NUM};
+    uint16_t uid = {0};
+    uint16_t rank = {0};
+    uint16_t seq = {0};
+    uint16_t len = {0};
+    uint8_t *data = {NULL};
+    uint8_t *src = {NULL};
+    uint8_t *dst = {NULL};
+
+    frame()
+    {}
+
+    frame(struct nl_msg *m, struct nlattr **attrs)
+        : msg(m)
+    {
+        if (attrs[BATADV_HLP_A_TYPE])
+            type = nla_get_u8(attrs[BATADV_HLP_A_TYPE]);
+
+        if (attrs[BATADV_HLP_A_BLOCK])
+            uid = nla_get_u16(attrs[BATADV_HLP_A_BLOCK]);
+
+        if (attrs[BATADV_HLP_A_RANK])
+            rank = nla_get_u16(attrs[BATADV_HLP_A_RANK]);
+
+        if (attrs[BATADV_HLP_A_SEQ])
+            seq = nla_get_u16(attrs[BATADV_HLP_A_SEQ]);
+
+        if (attrs[BATADV_HLP_A_FRAME]) {
+            data = static_cast<uint8_t *>(nla_data(attrs[BATADV_HLP_A_FRAME]));
+            len = nla_len(attrs[BATADV_HLP_A_FRAME]);
+        }
+
+        if (attrs[BATADV_HLP_A_SRC])
+            src = static_cast<uint8_t *>(nla_data(attrs[BATADV_HLP_A_SRC]));
+
+        if (attrs[BATADV_HLP_A_DST])
+            dst = static_cast<uint8_t *>(nla_data(attrs[BATADV_HLP_A_DST]));
+    }
+
+    /* FNV-1a over len bytes of p */
+    static uint32_t hash(uint32_t h, const uint8_t *p, size_t len)
+    {
+        for (size_t i = 0; i < len; ++i)
+            h = (h ^ p[i]) * 16777619;
+
+        return h;
+    }
+
+    /* Hash of the flow a plain frame belongs to: its source and destination
+     * and, with tuple set, the addresses, protocol and ports of the IP packet
+     * it carries
+     */
+    uint32_t flow(bool tuple) const
+    {
+        uint32_t h = 2166136261;
+        const uint8_t *ip = data;
+        size_t ip_len = len, hdr;
+        uint16_t ether;
+        uint8_t proto;
+        bool ports = true;
+
+        if (src)
+            h = hash(h, src, ETH_ALEN);
+
+        if (dst)
+            h = hash(h, dst, ETH_ALEN);
+
+        if (!tuple || !data)
+            return h;
+
+        /* frames from batman_adv start with an ethernet header, the ones
+         * read from a TUN device with the IP header
+         */
+        if (len > ETH_HLEN) {
+            ether = data[12] << 8 | data[13];
+
+            if (ether == ETH_P_IP || ether == ETH_P_IPV6) {
+                ip += ETH_HLEN;
+                ip_len -= ETH_HLEN;
+            }
+        }
+
+        if (ip_len >= 20 && ip[0] >> 4 == 4) {
+            hdr = (ip[0] & 0xf) * 4;
+            proto = ip[9];
+            h = hash(h, ip + 12, 8);
+
+            /* only the first fragment has the ports */
+            ports = !(ip[6] & 0x1f) && !ip[7];
+        } else if (ip_len >= 40 && ip[0] >> 4 == 6) {
+            hdr = 40;
+            proto = ip[6];
+            h = hash(h, ip + 8, 32);
+        } else {
+            return h;
+        }
+
+        h = hash(h, &proto, 1);
+
+        if (ports && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+            ip_len >= hdr + 4)
+            h = hash(h, ip + hdr, 4);
+
+        return h;
+    }
+};
+
+/* Header in front of frames carried outside of netlink by the UDP and packet
+ * ring backends; the fields are the ones otherwise sent as BATADV_HLP_A_*
+ * attributes, in network byte order.
+ */
+struct frame_hdr
+{
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t uid;
+    uint16_t rank;
+    uint16_t seq;
+} __attribute__((packed));
@@ -34,6 +34,9 @@ enum {
     BATADV_HLP_A_E1,
     BATADV_HLP_A_E2,
     BATADV_HLP_A_E3,
+    BATADV_HLP_A_TYPES,
+    BATADV_HLP_A_FRAMES,
+    BATADV_HLP_A_FEATURES,
     BATADV_HLP_A_NUM,
 };
 #define BATADV_HLP_A_MAX (BATADV_HLP_A_NUM - 1)
@@ -61,6 +64,19 @@ enum {
     BATADV_HLP_C_FRAME,
     BATADV_HLP_C_BLOCK,
     BATADV_HLP_C_UNBLOCK,
+    BATADV_HLP_C_FRAMES,
     BATADV_HLP_C_NUM,
 };
 #define BATADV_HLP_C_MAX (BATADV_HLP_C_NUM - 1)
+
+/* Optional protocol features, offered in BATADV_HLP_A_FEATURES at register
+ * time and enabled when the register reply carries them back. Kernels that
+ * do not know the attribute never reply with it.
+ */
+enum {
+    /* BATADV_HLP_C_FRAMES carries several frames, each a nested attribute
+     * in BATADV_HLP_A_FRAMES holding the attributes of a single frame;
+     * messages towards rlncd must still fit its 4096 byte receive buffers
+     */
+    BATADV_HLP_F_FRAMES = 1 << 0,
+};
@@ -1,29 +1,168 @@
 #include <gflags/gflags.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include <functional>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <sstream>
 #include "logging.hpp"
 #include "encoder_map.hpp"
 #include "decoder_map.hpp"
 #include "io.hpp"
 
 DECLARE_string(interface);
-DECLARE_bool(benchmark);
+DECLARE_bool(bounce);
+DECLARE_int32(symbols);
+DECLARE_int32(symbol_size);
+DECLARE_int32(msg_pool);
+DECLARE_int32(nl_buffer);
+DECLARE_int32(nl_buffer_max);
+DECLARE_int32(congestion_hold);
+DECLARE_int32(reactor_threads);
+DECLARE_string(coder_cpus);
+DECLARE_string(reader_cpus);
+DECLARE_string(writer_cpus);
+DECLARE_bool(single_thread);
+DECLARE_int32(io_sockets);
+DECLARE_int32(read_batch);
+DECLARE_int32(rx_pool);
+DECLARE_int32(write_batch);
+DECLARE_int32(write_queue);
 DECLARE_int32(encoders);
 DECLARE_int32(e1);
 DECLARE_int32(e2);
 DECLARE_int32(e3);
+DECLARE_string(write_sched);
+DECLARE_int32(write_deadline);
+DECLARE_string(pace_rate);
+DECLARE_int32(pace_burst);
+DECLARE_bool(nl_batch);
+
+/* size of each receive slot; must hold the largest datagram from the kernel */
+#define IO_RX_BUF_SIZE 4096
+
+/* room for the genl header and frame attributes besides the coded payload */
+#define IO_MSG_OVERHEAD 256
+
+/* protocol of receive buffers owned by io; real netlink protocols end at
+ * MAX_LINKS (32), and other messages carry one of those or -1
+ */
+#define IO_RX_TAG 0x726c6e00
+
+/* protocol of the FRAMES messages packed by the writer */
+#define IO_BATCH_TAG 0x726c6e01
+
+/* protocol of a received FRAMES message while its frames are in flight */
+#define IO_SPLIT_TAG 0x726c6e02
+
+/* largest FRAMES message packed by the writer */
+#define IO_BATCH_SIZE 16384
+
+/* log2 buckets of the queueing delay histograms, in microseconds */
+#define IO_DELAY_BUCKETS 16
+
+static const char *io_lane_names[PACKET_NUM + 1] = {
+    "plain", "enc", "red", "dec", "rec", "hlp", "req", "ack", "ctrl"
+};
+
+static const char *io_class_names[IO_CLASS_NUM] = {"data", "ctrl", "enc"};
+
+/* auto rated pacing, in bytes per second and growth per second */
+#define IO_PACE_AUTO_START 12.5e6
+#define IO_PACE_AUTO_MIN 125e3
+#define IO_PACE_AUTO_MAX 125e6
+#define IO_PACE_AUTO_GROWTH 0.1
+
+io::io()
+    : m_reactor(new reactor(FLAGS_single_thread ? 1 : FLAGS_reactor_threads,
+                            FLAGS_coder_cpus)),
+      m_wheel(new timer_wheel(m_reactor)),
+      m_rx_return(FLAGS_rx_pool * IO_CLASS_NUM),
+      m_msg_pool(new msg_pool(NLMSG_HDRLEN + GENL_HDRLEN + FLAGS_symbol_size +
+                              FLAGS_symbols + IO_MSG_OVERHEAD,
+                              FLAGS_msg_pool)),
+      m_write_queue(PACKET_NUM + 1, FLAGS_write_queue)
+{
+    counters_group("io");
+
+    /* one thread reads, codes and writes each frame to completion, with
+     * notifications between those steps queued inline instead of going
+     * through epoll
+     */
+    if (FLAGS_single_thread) {
+        LOG_IF(WARNING, !FLAGS_reader_cpus.empty() ||
+                        !FLAGS_writer_cpus.empty())
+            << "io: Reader and writer CPUs are ignored in single thread mode";
+        m_reactor->run_inline(true);
+    }
+
+    /* reader and writer share the coder threads unless pinned elsewhere */
+    if (!FLAGS_single_thread && !FLAGS_reader_cpus.empty())
+        m_read_group = m_reactor->add_group("read",
+                std::min(std::max(FLAGS_io_sockets, 1), int(IO_CLASS_NUM)),
+                FLAGS_reader_cpus);
+
+    if (!FLAGS_single_thread && !FLAGS_writer_cpus.empty())
+        m_write_group = m_reactor->add_group("write", 1, FLAGS_writer_cpus);
+
+    m_write_event = m_reactor->add_event(std::bind(&io::write_ready, this),
+                                         m_write_group);
+    m_congestion_timer = m_reactor->add_timer(
+            std::bind(&io::congestion_timer, this), m_write_group);
+    m_pace_timer = m_reactor->add_timer(std::bind(&io::pace_timer, this),
+                                        m_write_group);
+    m_tx_cache.pool(m_msg_pool);
+    m_backend_cache.pool(m_msg_pool);
+
+    CHECK(FLAGS_write_sched == "prio" || FLAGS_write_sched == "deadline")
+        << "io: Unknown write scheduler " << FLAGS_write_sched;
+    m_write_edf = FLAGS_write_sched == "deadline";
+    m_write_lanes.resize(PACKET_NUM + 1);
+    m_delay_hist.resize(PACKET_NUM + 1);
+    m_delay_names.resize(PACKET_NUM + 1);
+
+    for (size_t lane = 0; lane <= PACKET_NUM; ++lane) {
+        /* higher lanes get proportionally shorter deadlines */
+        m_write_deadline.push_back(std::chrono::microseconds(
+                FLAGS_write_deadline * (PACKET_NUM + 1 - lane)));
+        m_delay_hist[lane].resize(IO_DELAY_BUCKETS);
+
+        for (size_t b = 0; b < IO_DELAY_BUCKETS; ++b) {
+            std::string name = std::string("wq ") + io_lane_names[lane] +
+                               " delay ";
+
+            if (b < IO_DELAY_BUCKETS - 1)
+                name += "<" + std::to_string(2 << b) + "us";
+            else
+                name += ">=" + std::to_string(1 << b) + "us";
+
+            m_delay_names[lane].push_back(name);
+        }
+    }
+
+    pace_init();
+}
 
 io::~io()
 {
+    struct nl_msg *msg;
+    write_entry e;
+
     VLOG(LOG_INIT) << "destructor start";
     stop();
 
-    if (m_nlsock)
-        nl_socket_free(m_nlsock);
+    for (auto &sock : m_sockets) {
+        m_reactor->remove(nl_socket_get_fd(sock->nlsock));
+        nl_socket_free(sock->nlsock);
+        free(sock->nlcb);
+
+        for (auto msg : sock->rx_slots)
+            nlmsg_free(msg);
 
-    if (m_nlcb)
-        free(m_nlcb);
+        for (auto msg : sock->rx_free)
+            nlmsg_free(msg);
+    }
 
     if (m_nlcache)
         free(m_nlcache);
@@ -32,123 +171,194 @@ io::~io()
         free(m_nlfamily);
 
     m_write_lock.lock();
-    while (m_write_queue.size() > 0) {
-        nlmsg_free(m_write_queue.top());
-        m_write_queue.pop();
-    }
+    while (m_write_queue.pop(e))
+        if (e.msg)
+            nlmsg_free(e.msg);
+
+    for (auto &b : m_pace)
+        for (auto &h : b.held)
+            nlmsg_free(h.first.msg);
+
+    for (auto msg : m_batch_free)
+        nlmsg_free(msg);
     m_write_lock.unlock();
 
-    process_free_queue();
+    m_reactor->remove(m_write_event);
+    m_reactor->remove(m_congestion_timer);
+    m_reactor->remove(m_pace_timer);
+
+    while (m_rx_return.pop(msg))
+        nlmsg_free(msg);
     VLOG(LOG_INIT) << "destructor end";
 }
 
 void io::start()
 {
-    if (!m_nlsock)
-        return;
+    for (auto &sock : m_sockets) {
+        if (FLAGS_read_batch > 1) {
+            for (int i = 0; i < FLAGS_rx_pool; ++i)
+                sock->rx_free.push_back(rx_create());
+
+            sock->rx_slots.resize(FLAGS_read_batch);
+            sock->rx_hdrs.resize(FLAGS_read_batch);
+            sock->rx_iovs.resize(FLAGS_read_batch);
+
+            for (size_t i = 0; i < sock->rx_hdrs.size(); ++i) {
+                rx_refill(*sock, i);
+                memset(&sock->rx_hdrs[i], 0, sizeof(sock->rx_hdrs[i]));
+                sock->rx_hdrs[i].msg_hdr.msg_iov = &sock->rx_iovs[i];
+                sock->rx_hdrs[i].msg_hdr.msg_iovlen = 1;
+            }
+        }
 
-    std::lock_guard<std::mutex> read_lock(m_read_lock);
-    m_reader = std::thread(std::bind(&io::read_thread, this));
+        nl_socket_set_nonblocking(sock->nlsock);
+        m_reactor->add_fd(nl_socket_get_fd(sock->nlsock),
+                          std::bind(&io::read_ready, this, std::ref(*sock)),
+                          m_read_group);
+    }
 
-    std::lock_guard<std::mutex> write_lock(m_write_lock);
-    m_writer = std::thread(std::bind(&io::write_thread, this));
+    if (m_backend)
+        m_backend->start();
+
+    m_reactor->start();
 }
 
 void io::stop()
 {
-    m_write_lock.lock();
     m_running = false;
-    m_write_cond.notify_all();
-    m_write_lock.unlock();
+    m_reactor->stop();
 
-    if (m_writer.joinable())
-        m_writer.join();
-
-    if (m_nlsock)
-        genl_send_simple(m_nlsock, family(), BATADV_HLP_C_UNSPEC, 1, 0);
-
-    if (m_reader.joinable())
-        m_reader.join();
+    if (m_backend)
+        m_backend->stop();
 }
 
 void io::netlink_open()
 {
     std::string name("batman_adv");
+    size_t num = std::min(std::max(FLAGS_io_sockets, 1), int(IO_CLASS_NUM));
+    io_socket *sock;
+
+    if (m_backend) {
+        m_backend->open();
+        return;
+    }
+
+    for (size_t i = 0; i < num; ++i) {
+        m_sockets.emplace_back(new io_socket);
+        sock = m_sockets.back().get();
+        sock->owner = this;
+        sock->index = i;
+        sock->rx_counter = "sock" + std::to_string(i) + " rx";
+        sock->tx_counter = "sock" + std::to_string(i) + " tx";
+        sock->rx_cache.pool(m_msg_pool);
 
-    m_nlcb = CHECK_NOTNULL(nl_cb_alloc(NL_CB_CUSTOM));
+        sock->nlcb = CHECK_NOTNULL(nl_cb_alloc(NL_CB_CUSTOM));
 
-    m_nlsock = CHECK_NOTNULL(nl_socket_alloc_cb(m_nlcb));
+        sock->nlsock = CHECK_NOTNULL(nl_socket_alloc_cb(sock->nlcb));
 
-    CHECK_GE(genl_connect(m_nlsock), 0)
-        << "io: Failed to connect netlink socket";
+        CHECK_GE(genl_connect(sock->nlsock), 0)
+            << "io: Failed to connect netlink socket";
 
-    CHECK_GE(nl_socket_set_buffer_size(m_nlsock, 1048576, 1048576), 0)
-        << "IO: Unable to set socket buffer size";
+        CHECK_GE(nl_socket_set_buffer_size(sock->nlsock, FLAGS_nl_buffer,
+                                           FLAGS_nl_buffer), 0)
+            << "IO: Unable to set socket buffer size";
+        sock->rx_buffer = buffer_size(*sock, SO_RCVBUF);
+        sock->tx_buffer = buffer_size(*sock, SO_SNDBUF);
 
-    CHECK_GE(genl_ctrl_alloc_cache(m_nlsock, &m_nlcache), 0)
+        nl_cb_set(sock->nlcb, NL_CB_MSG_IN, NL_CB_CUSTOM, read_wrapper, sock);
+    }
+
+    CHECK_GE(genl_ctrl_alloc_cache(m_sockets[0]->nlsock, &m_nlcache), 0)
         << "IO: Failed to allocate control cache";
 
     m_nlfamily = CHECK_NOTNULL(genl_ctrl_search_by_name(m_nlcache,
                                                         name.c_str()));
     m_nlfamily_id = genl_family_get_id(m_nlfamily);
 
-    nl_cb_set(m_nlcb, NL_CB_MSG_IN, NL_CB_CUSTOM, read_wrapper, this);
+    /* tell each socket which packet types the kernel should deliver to it */
+    for (size_t type = 0; type < PACKET_NUM; ++type)
+        class_socket(type_class(type)).types |= 1 << type;
 }
 
 void io::netlink_register()
 {
-    struct nl_msg *msg = CHECK_NOTNULL(nlmsg_alloc());
+    struct nl_msg *msg;
 
-    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, family(), 0,
-                NLM_F_REQUEST, BATADV_HLP_C_REGISTER, 1));
+    if (m_backend) {
+        m_backend->register_node();
+        return;
+    }
+
+    for (auto &sock : m_sockets) {
+        msg = CHECK_NOTNULL(m_msg_pool->alloc());
+
+        CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, family(), 0,
+                    NLM_F_REQUEST, BATADV_HLP_C_REGISTER, 1));
+
+        CHECK_GE(nla_put_string(msg, BATADV_HLP_A_IFNAME,
+                                FLAGS_interface.c_str()), 0)
+            << "IO: Failed to put ifname attribute";
+
+        CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_ENCS, FLAGS_encoders), 0)
+                << "IO: Failed to put encoders attribute";
 
-    CHECK_GE(nla_put_string(msg, BATADV_HLP_A_IFNAME, FLAGS_interface.c_str()), 0)
-        << "IO: Failed to put ifname attribute";
+        CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_E1, FLAGS_e1), 0)
+                << "IO: Failed to put e1 attribute";
 
-    CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_ENCS, FLAGS_encoders), 0)
-            << "IO: Failed to put encoders attribute";
+        CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_E2, FLAGS_e2), 0)
+                << "IO: Failed to put e2 attribute";
 
-    CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_E1, FLAGS_e1), 0)
-            << "IO: Failed to put e1 attribute";
+        CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_E3, FLAGS_e3), 0)
+                << "IO: Failed to put e3 attribute";
 
-    CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_E2, FLAGS_e2), 0)
-            << "IO: Failed to put e2 attribute";
+        /* only split sockets need routing, so old kernels keep working */
+        if (m_sockets.size() > 1)
+            CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_TYPES, sock->types), 0)
+                << "IO: Failed to put types attribute";
 
-    CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_E3, FLAGS_e3), 0)
-            << "IO: Failed to put e3 attribute";
+        if (FLAGS_nl_batch)
+            CHECK_GE(nla_put_u32(msg, BATADV_HLP_A_FEATURES,
+                                 BATADV_HLP_F_FRAMES), 0)
+                << "IO: Failed to put features attribute";
 
-    add_msg(PACKET_NUM, msg);
+        std::lock_guard<std::mutex> lock(sock->tx_lock);
+        CHECK_GE(nl_send_auto(sock->nlsock, msg), 0)
+            << "IO: Failed to send register message";
+        m_tx_cache.release(msg);
+    }
 }
 
-void io::bounce_frame(struct nlattr **attrs)
+void io::bounce_frame(msg_pool::cache &cache, const struct frame &f)
 {
-    void *tmp = nla_data(attrs[BATADV_HLP_A_FRAME]);
-    uint8_t *data = reinterpret_cast<uint8_t *>(tmp);
-    size_t len = nla_len(attrs[BATADV_HLP_A_FRAME]);
-    struct nl_msg *msg = nlmsg_alloc();
+    struct nl_msg *msg = CHECK_NOTNULL(cache.alloc());
 
     genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family(),
                 0, 0, BATADV_HLP_C_FRAME, 1);
 
     nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_ifindex);
     nla_put_u8(msg, BATADV_HLP_A_TYPE, PLAIN_PACKET);
-    nla_put(msg, BATADV_HLP_A_FRAME, len, data);
+    nla_put(msg, BATADV_HLP_A_FRAME, f.len, f.data);
     add_msg(PLAIN_PACKET, msg);
 }
 
-void io::handle_frame(struct nl_msg *msg, struct nlattr **attrs)
+/* Ownership of the frame message passes to the map it is handed to */
+void io::handle_frame(const struct frame &f)
 {
-    switch (nla_get_u8(attrs[BATADV_HLP_A_TYPE])) {
+    switch (f.type) {
         case PLAIN_PACKET:
             counters_increment("plain");
-            if (auto encoder_map = m_encoder_map.lock())
-                encoder_map->add_plain(msg, attrs);
+            if (auto encoder_map = m_encoder_map.lock()) {
+                encoder_map->add_plain(f);
+                return;
+            }
             break;
 
         case ENC_PACKET:
             counters_increment("enc");
-            if (auto decoder_map = m_decoder_map.lock())
-                decoder_map->add_enc(msg, attrs);
+            if (auto decoder_map = m_decoder_map.lock()) {
+                decoder_map->add_enc(f);
+                return;
+            }
             break;
 
 /*
@@ -162,19 +372,23 @@ void io::handle_frame(struct nl_msg *msg, struct nlattr **attrs)
 */
         case REQ_PACKET:
             counters_increment("req");
-            if (auto encoder_map = m_encoder_map.lock())
-                encoder_map->add_req(msg, attrs);
+            if (auto encoder_map = m_encoder_map.lock()) {
+                encoder_map->add_req(f);
+                return;
+            }
             break;
 
         case ACK_PACKET:
             counters_increment("ack");
             if (auto encoder_map = m_encoder_map.lock())
-                encoder_map->add_ack(msg, attrs);
+                encoder_map->add_ack(f);
             break;
     }
+
+    free_msg(f.msg);
 }
 
-int io::read_msg(struct nl_msg *msg, void *arg)
+void io::dispatch_msg(msg_pool::cache &cache, struct nl_msg *msg)
 {
     struct nlmsghdr *nlh = nlmsg_hdr(msg);
     struct genlmsghdr *gnlh = (struct genlmsghdr *)nlmsg_data(nlh);
@@ -191,95 +405,842 @@ int io::read_msg(struct nl_msg *msg, void *arg)
             if (attrs[BATADV_HLP_A_IFINDEX])
                 m_ifindex = nla_get_u32(attrs[BATADV_HLP_A_IFINDEX]);
 
+            /* the reply only carries features the kernel agreed to */
+            if (attrs[BATADV_HLP_A_FEATURES] && FLAGS_nl_batch)
+                m_features = nla_get_u32(attrs[BATADV_HLP_A_FEATURES]) &
+                             BATADV_HLP_F_FRAMES;
+
             break;
 
         case BATADV_HLP_C_FRAME:
             VLOG(LOG_IO) << "received frame message";
             m_pkt_count++;
 
-            if (FLAGS_benchmark)
-                bounce_frame(attrs);
-            else
-                handle_frame(msg, attrs);
+            if (FLAGS_bounce) {
+                bounce_frame(cache, frame(msg, attrs));
+                break;
+            }
+
+            handle_frame(frame(msg, attrs));
+            return;
+
+        case BATADV_HLP_C_FRAMES:
+            VLOG(LOG_IO) << "received frames message";
+            counters_increment("rx batch");
+
+            if (attrs[BATADV_HLP_A_FRAMES])
+                split_frames(cache, msg, attrs[BATADV_HLP_A_FRAMES]);
 
             break;
     }
 
+    free_msg(msg);
+}
+
+/* Hand out the frames of a FRAMES message in place. Each frame points into
+ * msg and holds a reference on it, counted in nlmsg_seq next to the one of
+ * the reader, and free_msg() recycles msg with the last of them. The
+ * original protocol is kept in nlmsg_pid meanwhile.
+ */
+void io::split_frames(msg_pool::cache &cache, struct nl_msg *msg,
+                      struct nlattr *list)
+{
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    struct nlattr *attrs[BATADV_HLP_A_NUM];
+    struct nlattr *entry;
+    struct frame f;
+    int rem;
+
+    nlh->nlmsg_pid = nlmsg_get_proto(msg);
+    nlh->nlmsg_seq = 1;
+    nlmsg_set_proto(msg, IO_SPLIT_TAG);
+
+    nla_for_each_nested(entry, list, rem) {
+        if (nla_parse_nested(attrs, BATADV_HLP_A_MAX, entry, NULL) < 0) {
+            counters_increment("rx invalid");
+            continue;
+        }
+
+        f = frame(msg, attrs);
+        __atomic_add_fetch(&nlh->nlmsg_seq, 1, __ATOMIC_RELAXED);
+        counters_increment("rx");
+        m_pkt_count++;
+
+        if (FLAGS_bounce) {
+            bounce_frame(cache, f);
+            free_msg(f.msg);
+            continue;
+        }
+
+        handle_frame(f);
+    }
+}
+
+void io::notify_readers()
+{
     std::lock_guard<std::mutex> lock(m_cond_lock);
     m_wait_cond.notify_all();
+}
+
+int io::read_msg(struct nl_msg *msg, void *arg)
+{
+    struct io_socket *sock = reinterpret_cast<struct io_socket *>(arg);
+
+    counters_increment(sock->rx_counter.c_str());
+
+    /* libnl frees the message after the callback, keep it for our owner */
+    nlmsg_get(msg);
+    dispatch_msg(sock->rx_cache, msg);
+    notify_readers();
 
     return NL_STOP;
 }
 
-void io::process_free_queue()
+/* Receive buffer for the pool, tagged so that free_msg() recognizes it */
+struct nl_msg *io::rx_create()
+{
+    struct nl_msg *msg = CHECK_NOTNULL(nlmsg_alloc_size(IO_RX_BUF_SIZE));
+
+    nlmsg_set_proto(msg, IO_RX_TAG);
+
+    return msg;
+}
+
+struct nl_msg *io::rx_alloc(io_socket &sock)
 {
     struct nl_msg *msg;
-    std::lock_guard<std::mutex> lock(m_free_lock);
 
-    while (m_free_queue.size()) {
-        counters_increment("free");
-        VLOG(LOG_IO) << "free message";
-        msg = m_free_queue.top();
-        m_free_queue.pop();
-        nlmsg_free(msg);
+    if (sock.rx_free.empty()) {
+        while (m_rx_return.pop(msg)) {
+            if (sock.rx_free.size() < static_cast<size_t>(FLAGS_rx_pool))
+                sock.rx_free.push_back(msg);
+            else
+                nlmsg_free(msg);
+        }
     }
+
+    if (sock.rx_free.empty()) {
+        counters_increment("rx pool miss");
+        return rx_create();
+    }
+
+    msg = sock.rx_free.back();
+    sock.rx_free.pop_back();
+
+    return msg;
 }
 
-void io::read_thread()
+void io::rx_refill(io_socket &sock, size_t slot)
 {
-    int ret(0);
+    sock.rx_slots[slot] = rx_alloc(sock);
+    sock.rx_iovs[slot].iov_base = nlmsg_hdr(sock.rx_slots[slot]);
+    sock.rx_iovs[slot].iov_len = IO_RX_BUF_SIZE;
+}
 
-    while (m_running) {
-        ret = nl_recvmsgs_default(m_nlsock);
-        LOG_IF(ERROR, ret < 0) << "Netlink read error: " << nl_geterror(ret)
-                               << " (" << ret << ")";
-        process_free_queue();
+bool io::rx_filter(struct nlmsghdr *nlh)
+{
+    struct nlmsgerr *err;
+
+    if (nlh->nlmsg_type == NLMSG_ERROR) {
+        err = reinterpret_cast<struct nlmsgerr *>(nlmsg_data(nlh));
+        LOG_IF(ERROR, err->error) << "Netlink error message: "
+                                  << strerror(-err->error)
+                                  << " (" << err->error << ")";
+        return false;
     }
-    VLOG(LOG_INIT) << "read exit";
+
+    return nlh->nlmsg_type == family();
 }
 
-void io::write_thread()
+void io::read_batch(io_socket &sock)
 {
+    struct nlmsghdr *nlh, *next;
     struct nl_msg *msg;
-    int res, len;
+    int num, len, rem;
 
-    while (true) {
-        std::unique_lock<std::mutex> l(m_write_lock);
-        while (m_running && m_write_queue.empty())
-            m_write_cond.wait(l);
+    num = recvmmsg(nl_socket_get_fd(sock.nlsock), &sock.rx_hdrs[0],
+                   sock.rx_hdrs.size(), MSG_WAITFORONE, NULL);
 
-        if (!m_running)
-            break;
+    if (num < 0 && errno == ENOBUFS) {
+        counters_increment("rx overrun");
+        grow_buffer(sock, sock.rx_buffer, SO_RCVBUF);
+        set_congested();
+        return;
+    }
+
+    if (num < 0) {
+        LOG_IF(ERROR, errno != EINTR && errno != EAGAIN)
+            << "recvmmsg() failed (" << errno << ": " << strerror(errno)
+            << ")";
+        return;
+    }
+
+    counters_increment("rx recv");
+    counters_add(sock.rx_counter.c_str(), num);
+
+    for (int i = 0; i < num; ++i) {
+        nlh = nlmsg_hdr(sock.rx_slots[i]);
+        len = sock.rx_hdrs[i].msg_len;
+
+        if (sock.rx_hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            counters_increment("rx truncated");
+            continue;
+        }
 
-        msg = m_write_queue.top();
-        m_write_queue.pop();
+        if (!nlmsg_ok(nlh, len))
+            continue;
+
+        rem = len;
+        next = nlmsg_next(nlh, &rem);
 
-        l.unlock();
+        /* the common case of one message per datagram is handed on in the
+         * receive buffer itself, which comes back through free_msg()
+         */
+        if (!nlmsg_ok(next, rem)) {
+            if (!rx_filter(nlh))
+                continue;
 
-        if (!msg)
+            msg = sock.rx_slots[i];
+            rx_refill(sock, i);
+            dispatch_msg(sock.rx_cache, msg);
             continue;
+        }
+
+        for (; nlmsg_ok(nlh, len); nlh = nlmsg_next(nlh, &len)) {
+            if (!rx_filter(nlh))
+                continue;
+
+            msg = nlmsg_convert(nlh);
+            if (!msg)
+                continue;
+
+            dispatch_msg(sock.rx_cache, msg);
+        }
+    }
+
+    /* one wakeup for the whole batch */
+    notify_readers();
+}
 
-        len = nlmsg_total_size(nlmsg_datalen(nlmsg_hdr(msg)));
-        LOG_IF(ERROR, len > 1600 || len < 0)
+void io::read_ready(io_socket &sock)
+{
+    int ret(0);
+
+    if (!sock.rx_hdrs.empty()) {
+        read_batch(sock);
+        return;
+    }
+
+    ret = nl_recvmsgs_default(sock.nlsock);
+
+    /* libnl reports ENOBUFS from the socket as NLE_NOMEM */
+    if (ret == -NLE_NOMEM) {
+        counters_increment("rx overrun");
+        grow_buffer(sock, sock.rx_buffer, SO_RCVBUF);
+        set_congested();
+        return;
+    }
+
+    LOG_IF(ERROR, ret < 0 && ret != -NLE_AGAIN) << "Netlink read error: "
+                                                << nl_geterror(ret) << " ("
+                                                << ret << ")";
+}
+
+/* Finish a FRAMES message; one holding a single frame is not worth it */
+void io::pack_close(struct nl_msg *batch, struct nlattr *list)
+{
+    nla_nest_end(batch, list);
+
+    if (m_batch_frames.size() == 1) {
+        m_batch_msgs.push_back(m_batch_frames.front());
+        m_batch_free.push_back(batch);
+        m_batch_frames.clear();
+        return;
+    }
+
+    m_batch_msgs.push_back(batch);
+    counters_add("tx packed", m_batch_frames.size());
+
+    for (auto msg : m_batch_frames)
+        m_tx_cache.release(msg);
+
+    m_batch_frames.clear();
+}
+
+/* Pack runs of frame messages for a socket into FRAMES messages, copying the
+ * attributes of each frame into a nested attribute; other commands keep
+ * their place in between
+ */
+void io::pack_frames(io_socket &sock)
+{
+    struct nl_msg *batch = NULL;
+    struct nlattr *list = NULL, *entry;
+    struct genlmsghdr *gnlh;
+    size_t len;
+    void *data;
+
+    for (auto msg : sock.tx_msgs) {
+        gnlh = static_cast<struct genlmsghdr *>(nlmsg_data(nlmsg_hdr(msg)));
+        len = genlmsg_attrlen(gnlh, 0);
+
+        if (batch && (gnlh->cmd != BATADV_HLP_C_FRAME ||
+                      nlmsg_hdr(batch)->nlmsg_len + 2*NLA_HDRLEN +
+                      NLA_ALIGN(len) > IO_BATCH_SIZE)) {
+            pack_close(batch, list);
+            batch = NULL;
+        }
+
+        if (gnlh->cmd != BATADV_HLP_C_FRAME) {
+            m_batch_msgs.push_back(msg);
+            continue;
+        }
+
+        if (!batch) {
+            if (m_batch_free.empty()) {
+                batch = CHECK_NOTNULL(nlmsg_alloc_size(IO_BATCH_SIZE));
+                nlmsg_set_proto(batch, IO_BATCH_TAG);
+            } else {
+                batch = m_batch_free.back();
+                m_batch_free.pop_back();
+            }
+
+            msg_pool::reset(batch);
+            CHECK_NOTNULL(genlmsg_put(batch, NL_AUTO_PORT, NL_AUTO_SEQ,
+                                      family(), 0, 0, BATADV_HLP_C_FRAMES, 1));
+            list = nla_nest_start(batch, BATADV_HLP_A_FRAMES);
+        }
+
+        entry = nla_nest_start(batch, m_batch_frames.size() + 1);
+        data = CHECK_NOTNULL(nlmsg_reserve(batch, len, NLA_ALIGNTO));
+        memcpy(data, genlmsg_attrdata(gnlh, 0), len);
+        nla_nest_end(batch, entry);
+        m_batch_frames.push_back(msg);
+    }
+
+    if (batch)
+        pack_close(batch, list);
+
+    sock.tx_msgs.swap(m_batch_msgs);
+    m_batch_msgs.clear();
+}
+
+void io::send_batch(io_socket &sock, struct nl_msg **msgs, size_t num)
+{
+    struct sockaddr_nl peer;
+    struct nlmsghdr *nlh;
+    size_t sent = 0, failed = 0;
+    int res, len;
+
+    memset(&peer, 0, sizeof(peer));
+    peer.nl_family = AF_NETLINK;
+    peer.nl_pid = nl_socket_get_peer_port(sock.nlsock);
+
+    std::lock_guard<std::mutex> lock(sock.tx_lock);
+
+    for (size_t i = 0; i < num; ++i) {
+        nl_complete_msg(sock.nlsock, msgs[i]);
+        nlh = nlmsg_hdr(msgs[i]);
+
+        len = nlmsg_total_size(nlmsg_datalen(nlh));
+        LOG_IF(ERROR, len > IO_BATCH_SIZE || len < 0)
             << "message too long ("
             << ", length: " << len
-            << ", msg *: " << msg << ")";
-
-        if (m_nlsock) {
-            res = nl_send_auto(m_nlsock, msg);
-            LOG_IF(ERROR, res < 0) << "nl_send_auto() failed with " << res
-                                   << ": " << nl_geterror(res) << " (" << errno
-                                   << ": " << strerror(errno) << ")";
-            LOG_IF(ERROR, res < 0 && errno == 90) << "length too long: "
-                << nlmsg_total_size(nlmsg_datalen(nlmsg_hdr(msg)));
-            counters_increment("tx");
+            << ", msg *: " << msgs[i] << ")";
+
+        m_tx_iovs[i].iov_base = nlh;
+        m_tx_iovs[i].iov_len = nlh->nlmsg_len;
+
+        memset(&m_tx_hdrs[i], 0, sizeof(m_tx_hdrs[i]));
+        m_tx_hdrs[i].msg_hdr.msg_name = &peer;
+        m_tx_hdrs[i].msg_hdr.msg_namelen = sizeof(peer);
+        m_tx_hdrs[i].msg_hdr.msg_iov = &m_tx_iovs[i];
+        m_tx_hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (sent < num) {
+        res = sendmmsg(nl_socket_get_fd(sock.nlsock), &m_tx_hdrs[sent],
+                       num - sent, 0);
+
+        if (res < 0 && errno == EINTR)
+            continue;
+
+        /* the kernel ran out of room; retry once the buffer is larger, or
+         * give up on this message once it cannot grow any further and let
+         * the congestion hold the sources back
+         */
+        if (res < 0 && (errno == ENOBUFS || errno == EAGAIN)) {
+            counters_increment("tx overrun");
+            set_congested();
+
+            if (grow_buffer(sock, sock.tx_buffer, SO_SNDBUF))
+                continue;
+
+            counters_increment("tx overrun drop");
+            failed++;
+            sent++;
+            continue;
         }
 
-        if (res >= 0 || m_nlsock == NULL)
-            nlmsg_free(msg);
+        /* skip the failing message, so those behind it still go out */
+        if (res < 0) {
+            LOG(ERROR) << "sendmmsg() failed (" << errno << ": "
+                       << strerror(errno) << ")";
+            LOG_IF(ERROR, errno == EMSGSIZE) << "length too long: "
+                << m_tx_hdrs[sent].msg_hdr.msg_iov->iov_len;
+            counters_increment("tx error");
+            failed++;
+            sent++;
+            continue;
+        }
+
+        sent += res;
+        counters_increment("tx send");
+    }
+
+    counters_add("tx", sent - failed);
+    counters_add(sock.tx_counter.c_str(), sent - failed);
+
+    for (size_t i = 0; i < num; ++i) {
+        if (nlmsg_get_proto(msgs[i]) == IO_BATCH_TAG)
+            m_batch_free.push_back(msgs[i]);
+        else
+            m_tx_cache.release(msgs[i]);
+    }
+}
+
+/* Size of a socket buffer as set with setsockopt(); the kernel reports
+ * twice the value to account for its bookkeeping
+ */
+size_t io::buffer_size(io_socket &sock, int opt)
+{
+    socklen_t len;
+    int val;
+
+    len = sizeof(val);
+
+    if (getsockopt(nl_socket_get_fd(sock.nlsock), SOL_SOCKET, opt, &val,
+                   &len) < 0) {
+        PLOG(ERROR) << "IO: Failed to read socket buffer size";
+        return 0;
+    }
+
+    return val / 2;
+}
+
+bool io::grow_buffer(io_socket &sock, std::atomic<size_t> &size, int opt)
+{
+    size_t cur = size, next = std::min<size_t>(2*cur, FLAGS_nl_buffer_max);
+    int force = opt == SO_RCVBUF ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+    int fd = nl_socket_get_fd(sock.nlsock), val = next;
+
+    if (next <= cur)
+        return false;
+
+    /* the forced option passes rmem_max and wmem_max, but needs
+     * CAP_NET_ADMIN; without it the kernel clamps the plain one silently
+     */
+    if (setsockopt(fd, SOL_SOCKET, force, &val, sizeof(val)) < 0 &&
+        setsockopt(fd, SOL_SOCKET, opt, &val, sizeof(val)) < 0) {
+        PLOG(ERROR) << "IO: Failed to grow socket buffer";
+        return false;
+    }
+
+    next = buffer_size(sock, opt);
+
+    /* stuck at the system limit; stop growing and retrying */
+    if (next <= cur) {
+        LOG(WARNING) << "IO: Socket " << sock.index << " "
+                     << (opt == SO_RCVBUF ? "rx" : "tx") << " buffer stuck at "
+                     << cur << " bytes, raise net.core."
+                     << (opt == SO_RCVBUF ? "rmem_max" : "wmem_max");
+        counters_increment(opt == SO_RCVBUF ? "rx grow limit"
+                                            : "tx grow limit");
+        size = FLAGS_nl_buffer_max;
+        return false;
+    }
+
+    VLOG(LOG_IO) << "grow socket " << sock.index << " "
+                 << (opt == SO_RCVBUF ? "rx" : "tx") << " buffer to " << next;
+    counters_increment(opt == SO_RCVBUF ? "rx grow" : "tx grow");
+    size = next;
+
+    return true;
+}
+
+/* Enter congestion, or extend it; the timer holds the encoders back */
+/* Kernel overruns also make auto rated pacing back off */
+void io::set_congested()
+{
+    m_pace_backoff = true;
+    hold_congestion();
+}
+
+/* Lock free, as the writer calls this from write_flush() with the write
+ * lock held; the congestion timer acts on the flag
+ */
+void io::hold_congestion()
+{
+    clock::duration hold = std::chrono::milliseconds(FLAGS_congestion_hold);
+
+    m_congestion_end = (clock::now() + hold).time_since_epoch().count();
+
+    if (m_congested.exchange(true))
+        return;
+
+    counters_increment("congested");
+    m_reactor->arm(m_congestion_timer, clock::duration(0));
+}
+
+/* Tell the encoders about congestion changes and leave congestion once no
+ * overrun has been seen for the hold time. The encoder map may queue a BLOCK
+ * message and flush the write queue itself, which can end up in
+ * set_congested() again, so no lock is held here. Timer runs never overlap.
+ */
+void io::congestion_timer()
+{
+    clock::rep now = clock::now().time_since_epoch().count();
+    bool changed;
+
+    if (m_congested && now >= m_congestion_end) {
+        m_congested = false;
+
+        /* an overrun racing with the reset has moved the end again */
+        if (m_congestion_end > now)
+            m_congested = true;
+    }
+
+    changed = m_congested != m_backpressure;
+    m_backpressure = m_congested;
+
+    if (m_backpressure)
+        m_reactor->arm(m_congestion_timer,
+                       clock::duration(m_congestion_end - now));
+
+    if (!changed)
+        return;
+
+    if (auto encoder_map = m_encoder_map.lock())
+        encoder_map->backpressure(m_backpressure);
+}
+
+void io::write_wake()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (!m_write_waiting)
+        return;
+
+    m_reactor->notify(m_write_event);
+}
+
+/* Record the queueing delay of a frame and route it to its transmit list */
+void io::write_take(const write_entry &e, size_t lane, clock::time_point now)
+{
+    uint64_t us;
+    size_t bucket = 0;
+
+    if (!e.msg)
+        return;
+
+    us = std::chrono::duration_cast<std::chrono::microseconds>(
+            now - e.stamp).count();
+
+    while (us > 1 && bucket < IO_DELAY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    m_delay_hist[lane][bucket]++;
+
+    if (pace_admit(e, lane, now))
+        write_route(e.msg, lane);
+}
+
+void io::write_route(struct nl_msg *msg, size_t lane)
+{
+    if (m_backend) {
+        m_backend_msgs.push_back(msg);
+        return;
+    }
+
+    if (m_sockets.empty()) {
+        m_tx_cache.release(msg);
+        return;
+    }
+
+    class_socket(type_class(lane)).tx_msgs.push_back(msg);
+}
+
+/* Parse --pace_rate, a comma separated list of class=kbit/s or class=auto */
+void io::pace_init()
+{
+    std::stringstream list(FLAGS_pace_rate);
+    std::string item, name, rate;
+    size_t eq, cls;
+
+    m_pace.resize(IO_CLASS_NUM);
+
+    while (std::getline(list, item, ',')) {
+        if (item.empty())
+            continue;
+
+        eq = item.find('=');
+        CHECK_NE(eq, std::string::npos) << "io: Invalid pace rate " << item;
+        name = item.substr(0, eq);
+        rate = item.substr(eq + 1);
+
+        for (cls = 0; cls < IO_CLASS_NUM; ++cls)
+            if (name == io_class_names[cls])
+                break;
+
+        CHECK_LT(cls, IO_CLASS_NUM) << "io: Unknown traffic class " << name;
+        pace_bucket &b = m_pace[cls];
+
+        if (rate == "auto") {
+            b.autorate = true;
+            b.rate = IO_PACE_AUTO_START;
+        } else {
+            b.rate = std::stod(rate) * 1000 / 8;
+        }
+
+        b.tokens = FLAGS_pace_burst;
+        b.last = clock::now();
+    }
+}
+
+/* Let a frame pass its class bucket, or hold it back; frames may overdraw
+ * the bucket so that any frame size gets through
+ */
+bool io::pace_admit(const write_entry &e, size_t lane, clock::time_point now)
+{
+    pace_bucket &b = m_pace[type_class(lane)];
+
+    if (!b.rate)
+        return true;
+
+    if (b.held.empty() && b.tokens > 0) {
+        b.tokens -= nlmsg_hdr(e.msg)->nlmsg_len;
+        return true;
+    }
+
+    b.held.push_back(std::make_pair(write_entry{e.msg, now}, lane));
+
+    /* a long backlog slows the sources down like a kernel overrun would;
+     * only flags congestion, as the write lock is held here
+     */
+    if (b.held.size() > static_cast<size_t>(FLAGS_write_queue))
+        hold_congestion();
+
+    return false;
+}
+
+/* Refill the buckets and send what they now allow from the held frames */
+void io::pace_release(clock::time_point now)
+{
+    bool backoff = m_pace_backoff.exchange(false);
+    double dt;
+
+    for (auto &b : m_pace) {
+        if (!b.rate)
+            continue;
+
+        dt = std::chrono::duration<double>(now - b.last).count();
+        b.last = now;
+
+        if (b.autorate && backoff)
+            b.rate = std::max(b.rate / 2, IO_PACE_AUTO_MIN);
+        else if (b.autorate)
+            b.rate = std::min(b.rate * (1 + IO_PACE_AUTO_GROWTH * dt),
+                              IO_PACE_AUTO_MAX);
+
+        b.tokens = std::min(b.tokens + b.rate * dt, double(FLAGS_pace_burst));
+
+        while (!b.held.empty() && b.tokens > 0) {
+            auto &h = b.held.front();
+
+            b.tokens -= nlmsg_hdr(h.first.msg)->nlmsg_len;
+            b.held_count++;
+            b.held_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                    now - h.first.stamp).count();
+            write_route(h.first.msg, h.second);
+            b.held.pop_front();
+        }
+    }
+}
+
+/* Wake the writer when the first bucket with held frames has tokens again */
+void io::pace_arm()
+{
+    std::chrono::duration<double> wait, first = std::chrono::hours(1);
+    bool held = false;
+
+    for (auto &b : m_pace) {
+        if (b.held.empty())
+            continue;
+
+        wait = std::chrono::duration<double>(-b.tokens / b.rate);
+        first = std::min(first, wait);
+        held = true;
+    }
+
+    if (held)
+        m_reactor->arm(m_pace_timer,
+                       std::chrono::duration_cast<clock::duration>(first));
+}
+
+void io::pace_timer()
+{
+    write_ready();
+}
+
+/* Take up to max frames in order of their deadline; the lane backlogs are
+ * refilled first so new arrivals compete with what is already waiting
+ */
+bool io::write_pick(size_t max)
+{
+    clock::time_point now = clock::now(), deadline, best_deadline;
+    size_t picked = 0, best;
+    write_entry e;
+
+    for (size_t lane = 0; lane < m_write_lanes.size(); ++lane)
+        while (m_write_lanes[lane].size() < max &&
+               m_write_queue.pop_lane(lane, e))
+            m_write_lanes[lane].push_back(e);
+
+    while (picked < max) {
+        best = m_write_lanes.size();
+
+        /* ties go to the higher lane */
+        for (size_t lane = m_write_lanes.size(); lane-- > 0;) {
+            if (m_write_lanes[lane].empty())
+                continue;
+
+            deadline = m_write_lanes[lane].front().stamp +
+                       m_write_deadline[lane];
+
+            if (best == m_write_lanes.size() || deadline < best_deadline) {
+                best = lane;
+                best_deadline = deadline;
+            }
+        }
+
+        if (best == m_write_lanes.size())
+            break;
+
+        if (best_deadline < now)
+            m_write_late++;
+
+        write_take(m_write_lanes[best].front(), best, now);
+        m_write_lanes[best].pop_front();
+        picked++;
+    }
+
+    return picked > 0;
+}
+
+/* Hand the frames taken from the queue to the backend or the sockets */
+void io::write_send(size_t max)
+{
+    size_t num;
+
+    for (size_t i = 0; i < m_backend_msgs.size(); i += num) {
+        num = std::min(m_backend_msgs.size() - i, max);
+        m_backend->send(&m_backend_msgs[i], num);
+        counters_add("tx", num);
     }
 
-    VLOG(LOG_INIT) << "write exit";
+    for (auto msg : m_backend_msgs)
+        m_tx_cache.release(msg);
+
+    m_backend_msgs.clear();
+
+    for (auto &sock : m_sockets) {
+        if (m_features & BATADV_HLP_F_FRAMES)
+            pack_frames(*sock);
+
+        for (size_t i = 0; i < sock->tx_msgs.size(); i += num) {
+            num = std::min(sock->tx_msgs.size() - i, max);
+            send_batch(*sock, &sock->tx_msgs[i], num);
+        }
+
+        sock->tx_msgs.clear();
+    }
+}
+
+/* Export the delay histograms gathered during a flush */
+void io::write_stats()
+{
+    for (size_t lane = 0; lane < m_delay_hist.size(); ++lane) {
+        for (size_t b = 0; b < IO_DELAY_BUCKETS; ++b) {
+            if (!m_delay_hist[lane][b])
+                continue;
+
+            counters_add(m_delay_names[lane][b].c_str(),
+                         m_delay_hist[lane][b]);
+            m_delay_hist[lane][b] = 0;
+        }
+    }
+
+    if (m_write_late) {
+        counters_add("wq late", m_write_late);
+        m_write_late = 0;
+    }
+
+    for (size_t cls = 0; cls < m_pace.size(); ++cls) {
+        pace_bucket &b = m_pace[cls];
+        std::string name = std::string("pace ") + io_class_names[cls];
+
+        if (!b.held_count)
+            continue;
+
+        counters_add((name + " held").c_str(), b.held_count);
+        counters_add((name + " wait us").c_str(), b.held_us);
+        b.held_count = 0;
+        b.held_us = 0;
+    }
+}
+
+/* Send everything queued so far, in priority order or by deadline;
+ * m_write_lock is held
+ */
+void io::write_flush()
+{
+    size_t max = std::max(FLAGS_write_batch, 1), prio;
+    clock::time_point now = clock::now();
+    write_entry e;
+
+    m_tx_hdrs.resize(max);
+    m_tx_iovs.resize(max);
+
+    /* held frames go first to keep the order within a class */
+    pace_release(now);
+
+    if (m_write_edf) {
+        while (write_pick(max))
+            write_send(max);
+    } else {
+        while (m_write_queue.pop(e, prio))
+            write_take(e, prio, now);
+    }
+
+    write_send(max);
+    pace_arm();
+    write_stats();
+}
+
+void io::write_ready()
+{
+    do {
+        m_write_waiting = false;
+
+        m_write_lock.lock();
+        write_flush();
+        m_write_lock.unlock();
+
+        /* recheck after announcing the wait to not miss a wakeup */
+        m_write_waiting = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    } while (m_running && !m_write_queue.empty());
 }
 
 void io::write_lock()
@@ -289,24 +1250,169 @@ void io::write_lock()
 
 void io::write_unlock()
 {
-    m_write_cond.notify_one();
     m_write_lock.unlock();
+    write_wake();
 }
 
 void io::add_msg_unlocked(uint8_t type, struct nl_msg *msg)
 {
-    m_write_queue.push(type, msg);
+    write_entry e = {msg, clock::now()};
+
+    if (m_write_queue.push(type, e))
+        return;
+
+    /* lane is full; make room ourselves if the writer is not running, as
+     * it may be waiting for the reactor thread we are on
+     */
+    counters_increment("write full");
+
+    do {
+        if (m_write_lock.try_lock()) {
+            write_flush();
+            m_write_lock.unlock();
+        } else {
+            std::this_thread::yield();
+        }
+    } while (!m_write_queue.push(type, e));
 }
 
 void io::add_msg(uint8_t type, struct nl_msg *msg)
 {
-    write_lock();
     add_msg_unlocked(type, msg);
-    write_unlock();
+    write_wake();
 }
 
 void io::free_msg(struct nl_msg *msg)
 {
-    std::lock_guard<std::mutex> lock(m_free_lock);
-    m_free_queue.push(0, msg);
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+
+    /* a FRAMES message is only released with its last frame */
+    if (nlmsg_get_proto(msg) == IO_SPLIT_TAG) {
+        if (__atomic_sub_fetch(&nlh->nlmsg_seq, 1, __ATOMIC_ACQ_REL))
+            return;
+
+        nlmsg_set_proto(msg, nlh->nlmsg_pid);
+    }
+
+    /* receive buffers go straight back to the reader; anything else, like
+     * messages from libnl or split out of a datagram, is freed, even when
+     * its size happens to match
+     */
+    if (nlmsg_get_proto(msg) == IO_RX_TAG &&
+        nlmsg_get_max_size(msg) == IO_RX_BUF_SIZE && m_rx_return.push(msg))
+        return;
+
+    /* frames delivered in place are returned to the backend that owns them */
+    if (m_backend && m_backend->release(msg))
+        return;
+
+    nlmsg_free(msg);
+}
+
+/* Frames received by a backend; must be called from one thread at a time */
+void io::deliver(struct nl_msg *msg)
+{
+    dispatch_msg(m_backend_cache, msg);
+    notify_readers();
+}
+
+/* Frames a backend has already parsed, with data pointing into its own
+ * memory; f.msg is only a handle given back through io_backend::release()
+ */
+void io::deliver_frame(const struct frame &f)
+{
+    counters_increment("rx");
+    m_pkt_count++;
+
+    if (FLAGS_bounce) {
+        bounce_frame(m_backend_cache, f);
+        free_msg(f.msg);
+    } else {
+        handle_frame(f);
+    }
+
+    notify_readers();
+}
+
+/* Check frames from outside the kernel before they reach the coders: a
+ * plain frame has to fit a symbol next to its length and a coded one has to
+ * be exactly as long as the decoders expect
+ */
+bool io::frame_valid(uint8_t type, size_t len)
+{
+    switch (type) {
+        case PLAIN_PACKET:
+            return len + sizeof(uint16_t) <= size_t(FLAGS_symbol_size);
+
+        case ENC_PACKET:
+            if (auto decoder_map = m_decoder_map.lock())
+                return len == decoder_map->payload_size();
+
+            return true;
+
+        case REQ_PACKET:
+        case ACK_PACKET:
+            return true;
+    }
+
+    return false;
+}
+
+/* Copy a frame delivered in place by the backend into a receive buffer of
+ * its own, for holders that may keep it for long; other frames are returned
+ * unchanged
+ */
+struct frame io::detach_frame(const struct frame &f)
+{
+    struct frame copy = f;
+    struct nlattr *attr;
+
+    if (!m_backend || !m_backend->pinned(f.msg))
+        return f;
+
+    copy.msg = rx_buffer(NLMSG_HDRLEN + GENL_HDRLEN + 3*NLA_HDRLEN +
+                         NLA_ALIGN(f.len) + 2*NLA_ALIGN(ETH_ALEN));
+    msg_pool::reset(copy.msg);
+    CHECK_NOTNULL(genlmsg_put(copy.msg, NL_AUTO_PORT, NL_AUTO_SEQ, family(),
+                              0, 0, BATADV_HLP_C_FRAME, 1));
+
+    attr = CHECK_NOTNULL(nla_reserve(copy.msg, BATADV_HLP_A_FRAME, f.len));
+    copy.data = static_cast<uint8_t *>(nla_data(attr));
+    memcpy(copy.data, f.data, f.len);
+
+    if (f.src) {
+        attr = CHECK_NOTNULL(nla_reserve(copy.msg, BATADV_HLP_A_SRC,
+                                         ETH_ALEN));
+        copy.src = static_cast<uint8_t *>(nla_data(attr));
+        memcpy(copy.src, f.src, ETH_ALEN);
+    }
+
+    if (f.dst) {
+        attr = CHECK_NOTNULL(nla_reserve(copy.msg, BATADV_HLP_A_DST,
+                                         ETH_ALEN));
+        copy.dst = static_cast<uint8_t *>(nla_data(attr));
+        memcpy(copy.dst, f.dst, ETH_ALEN);
+    }
+
+    counters_increment("rx detach");
+    free_msg(f.msg);
+
+    return copy;
+}
+
+/* Buffer for a backend to receive len bytes into, recycled like the
+ * netlink receive buffers when it is large enough
+ */
+struct nl_msg *io::rx_buffer(size_t len)
+{
+    struct nl_msg *msg;
+
+    if (len > IO_RX_BUF_SIZE)
+        return CHECK_NOTNULL(nlmsg_alloc_size(len));
+
+    if (m_rx_return.pop(msg))
+        return msg;
+
+    counters_increment("rx pool miss");
+    return rx_create();
 }
@@ -6,16 +6,27 @@
 #include <netlink/genl/family.h>
 #include <netlink/genl/mngt.h>
 
+#include <sys/socket.h>
+
 #include <thread>
 #include <mutex>
 #include <atomic>
 #include <deque>
 #include <queue>
 #include <condition_variable>
+#include <chrono>
 #include <memory>
+#include <vector>
+#include <string>
 
 #include "queue.hpp"
+#include "ring_queue.hpp"
+#include "msg_pool.hpp"
+#include "reactor.hpp"
+#include "timer_wheel.hpp"
+#include "io_backend.hpp"
 #include "io-api.hpp"
+#include "frame.hpp"
 #include "counters.hpp"
 
 class encoder_map;
@@ -23,45 +34,192 @@ class decoder_map;
 typedef std::weak_ptr<encoder_map> encoder_map_ptr;
 typedef std::weak_ptr<decoder_map> decoder_map_ptr;
 
+/* Traffic classes that can be given a netlink socket of their own */
+enum io_class {
+    IO_CLASS_DATA = 0,
+    IO_CLASS_CTRL,
+    IO_CLASS_ENC,
+    IO_CLASS_NUM,
+};
+
 class io : public counters_api
 {
+    /* One generic netlink socket, read from its own reactor callback */
+    struct io_socket
+    {
+        io *owner;
+        size_t index;
+        uint32_t types = {0};
+        struct nl_sock *nlsock = {NULL};
+        struct nl_cb *nlcb = {NULL};
+        std::mutex tx_lock;
+        std::string rx_counter, tx_counter;
+        std::atomic<size_t> rx_buffer = {0}, tx_buffer = {0};
+
+        /* outgoing messages created by this reader, like bounced frames */
+        msg_pool::cache rx_cache;
+
+        /* batched receive into recycled buffers */
+        std::vector<struct nl_msg *> rx_slots, rx_free;
+        std::vector<struct mmsghdr> rx_hdrs;
+        std::vector<struct iovec> rx_iovs;
+
+        /* frames taken from the write queue for this socket */
+        std::vector<struct nl_msg *> tx_msgs;
+    };
+
     /* Members for generic netlink */
-    struct nl_sock *m_nlsock = {NULL};
+    std::vector<std::unique_ptr<io_socket> > m_sockets;
     struct nl_cache *m_nlcache = {NULL};
-    struct nl_cb *m_nlcb = {NULL};
     struct genl_family *m_nlfamily = {NULL};
     std::atomic<uint32_t> m_ifindex, m_nlfamily_id, m_pkt_count = {0};
+    std::atomic<uint32_t> m_features = {0};
+
+    /* Members for event handling */
+    reactor::pointer m_reactor;
+    timer_wheel::pointer m_wheel;
+    size_t m_read_group = {0}, m_write_group = {0};
+    std::atomic<bool> m_running = {true}, m_write_waiting = {true};
+    std::mutex m_write_lock, m_cond_lock;
+    std::condition_variable m_wait_cond;
+    int m_write_event, m_congestion_timer;
+
+    /* Kernel side overruns put io in congestion for a while */
+    typedef std::chrono::steady_clock clock;
+    std::atomic<bool> m_congested = {false};
+    std::atomic<clock::rep> m_congestion_end = {0};
+    bool m_backpressure = {false};
+
+    /* Receive buffers handed back by the coders */
+    ring_queue<struct nl_msg *> m_rx_return;
+
+    /* Alternative transport replacing the netlink sockets */
+    io_backend::pointer m_backend;
+    std::vector<struct nl_msg *> m_backend_msgs;
+    msg_pool::cache m_backend_cache;
+
+    /* Members for batched transmit */
+    std::vector<struct mmsghdr> m_tx_hdrs;
+    std::vector<struct iovec> m_tx_iovs;
+
+    /* FRAMES messages packed by the writer, recycled after sending */
+    std::vector<struct nl_msg *> m_batch_msgs, m_batch_free, m_batch_frames;
 
-    /* Members for thread handling */
-    std::atomic<bool> m_running = {true};
-    std::thread m_reader, m_writer;
-    std::mutex m_read_lock, m_write_lock, m_free_lock, m_cond_lock;
-    std::condition_variable m_write_cond, m_wait_cond;
-
-    void bounce_frame(struct nlattr **attrs);
-    void handle_frame(struct nl_msg *msg, struct nlattr **attrs);
-    void process_free_queue();
-    void read_thread();
-    void write_thread();
+    /* Queued frames carry their enqueue time for deadline scheduling and
+     * the per-lane queueing delay histograms
+     */
+    struct write_entry
+    {
+        struct nl_msg *msg;
+        clock::time_point stamp;
+    };
+
+    /* with --write_sched=deadline the writer keeps a backlog per lane and
+     * sends the frame with the earliest deadline first
+     */
+    bool m_write_edf = {false};
+    std::vector<std::deque<write_entry> > m_write_lanes;
+    std::vector<clock::duration> m_write_deadline;
+    std::vector<std::vector<size_t> > m_delay_hist;
+    std::vector<std::vector<std::string> > m_delay_names;
+    size_t m_write_late = {0};
+
+    /* Token bucket per class spacing out what the writer sends; frames
+     * without tokens are held back until the pacing timer fires. Auto rated
+     * buckets halve their rate on kernel overruns and grow back slowly.
+     */
+    struct pace_bucket
+    {
+        double rate = {0};
+        bool autorate = {false};
+        double tokens = {0};
+        clock::time_point last;
+        std::deque<std::pair<write_entry, size_t> > held;
+        size_t held_count = {0};
+        uint64_t held_us = {0};
+    };
+
+    std::vector<pace_bucket> m_pace;
+    std::atomic<bool> m_pace_backoff = {false};
+    int m_pace_timer;
+
+    /* Outgoing message pool with a cache for the writer thread */
+    msg_pool::pointer m_msg_pool;
+    msg_pool::cache m_tx_cache;
+
+    void bounce_frame(msg_pool::cache &cache, const struct frame &f);
+    void handle_frame(const struct frame &f);
+    struct nl_msg *rx_create();
+    struct nl_msg *rx_alloc(io_socket &sock);
+    void rx_refill(io_socket &sock, size_t slot);
+    bool rx_filter(struct nlmsghdr *nlh);
+    void dispatch_msg(msg_pool::cache &cache, struct nl_msg *msg);
+    void split_frames(msg_pool::cache &cache, struct nl_msg *msg,
+                      struct nlattr *list);
+    void pack_frames(io_socket &sock);
+    void pack_close(struct nl_msg *batch, struct nlattr *list);
+    void notify_readers();
+    void read_batch(io_socket &sock);
+    void read_ready(io_socket &sock);
+    void write_take(const write_entry &e, size_t lane, clock::time_point now);
+    void write_route(struct nl_msg *msg, size_t lane);
+    void pace_init();
+    bool pace_admit(const write_entry &e, size_t lane, clock::time_point now);
+    void pace_release(clock::time_point now);
+    void pace_arm();
+    void pace_timer();
+    bool write_pick(size_t max);
+    void write_send(size_t max);
+    void write_stats();
+    void write_flush();
+    void write_ready();
+    void write_wake();
+    void send_batch(io_socket &sock, struct nl_msg **msgs, size_t num);
+    size_t buffer_size(io_socket &sock, int opt);
+    bool grow_buffer(io_socket &sock, std::atomic<size_t> &size, int opt);
+    void hold_congestion();
+    void congestion_timer();
     int read_msg(struct nl_msg *msg, void *arg);
 
+    static size_t type_class(size_t type)
+    {
+        switch (type) {
+            case ENC_PACKET:
+            case RED_PACKET:
+            case HLP_PACKET:
+            case REC_PACKET:
+                return IO_CLASS_ENC;
+
+            case REQ_PACKET:
+            case ACK_PACKET:
+            case PACKET_NUM:
+                return IO_CLASS_CTRL;
+
+            default:
+                return IO_CLASS_DATA;
+        }
+    }
+
+    /* classes without a socket of their own share the first one */
+    io_socket &class_socket(size_t cls)
+    {
+        return *m_sockets[cls < m_sockets.size() ? cls : 0];
+    }
+
     /* Producer/consumber members */
-    prio_queue<struct nl_msg *> m_write_queue, m_free_queue;
+    prio_ring_queue<write_entry> m_write_queue;
     encoder_map_ptr m_encoder_map;
     decoder_map_ptr m_decoder_map;
 
     static int read_wrapper(struct nl_msg *msg, void *arg)
     {
-        return ((class io *)arg)->read_msg(msg, NULL);
+        return ((struct io_socket *)arg)->owner->read_msg(msg, arg);
     }
 
   public:
     typedef std::shared_ptr<io> pointer;
 
-    io() : m_write_queue(PACKET_NUM + 1, NULL), m_free_queue(1, NULL)
-    {
-        counters_group("io");
-    }
+    io();
     ~io();
     void start();
     void stop();
@@ -72,6 +230,23 @@ class io : public counters_api
     void add_msg_unlocked(uint8_t type, struct nl_msg *msg);
     void add_msg(uint8_t type, struct nl_msg *msg);
     void free_msg(struct nl_msg *msg);
+    void deliver(struct nl_msg *msg);
+    void deliver_frame(const struct frame &f);
+    bool frame_valid(uint8_t type, size_t len);
+    struct frame detach_frame(const struct frame &f);
+
+    /* report a transmit or receive overrun; lock free, so backends may call
+     * it from send()
+     */
+    void set_congested();
+    struct nl_msg *rx_buffer(size_t len);
+
+    /* use backend instead of netlink; must be set before netlink_open() */
+    void set_backend(io_backend::pointer backend)
+    {
+        m_backend = backend;
+        m_backend->attach(this);
+    }
 
     template<typename func, class duration>
     void wait(func &cond, duration &sleep)
@@ -90,6 +265,32 @@ class io : public counters_api
         m_decoder_map = dec;
     }
 
+    msg_pool::pointer pool() const
+    {
+        return m_msg_pool;
+    }
+
+    reactor::pointer loop() const
+    {
+        return m_reactor;
+    }
+
+    timer_wheel::pointer wheel() const
+    {
+        return m_wheel;
+    }
+
+    /* reactor group for descriptors delivering received frames */
+    size_t read_group() const
+    {
+        return m_read_group;
+    }
+
+    bool congested() const
+    {
+        return m_congested;
+    }
+
     uint32_t family() const
     {
         return m_nlfamily_id.load();
@@ -115,10 +316,28 @@ class io_base
 {
   protected:
       io::pointer m_io;
+      msg_pool::cache m_msg_cache;
+
+      struct nl_msg *alloc_msg()
+      {
+          return m_msg_cache.alloc();
+      }
+
+      void free_msg(struct nl_msg *msg)
+      {
+          if (m_io)
+              m_io->free_msg(msg);
+          else
+              nlmsg_free(msg);
+      }
 
   public:
-    void set_io(io::pointer io)
+    virtual ~io_base()
+    {}
+
+    virtual void set_io(io::pointer io)
     {
         m_io = io;
+        m_msg_cache.pool(io ? io->pool() : msg_pool::pointer());
     }
 };
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <netlink/netlink.h>
+#include <memory>
+
+class io;
+
+/* Transport used by io instead of the batman_adv generic netlink family.
+ * Outgoing frames are complete generic netlink messages handed over by the
+ * io writer, and received frames are given back to io as such with
+ * io::deliver(), so the maps and coders work the same on every transport.
+ */
+class io_backend
+{
+  protected:
+    io *m_io = {NULL};
+
+  public:
+    typedef std::shared_ptr<io_backend> pointer;
+
+    virtual ~io_backend()
+    {}
+
+    void attach(io *owner)
+    {
+        m_io = owner;
+    }
+
+    /* prepare the transport; the io reactor is available but not running */
+    virtual void open() = 0;
+
+    /* announce ourselves; the reply must deliver a REGISTER with ifindex */
+    virtual void register_node() = 0;
+
+    virtual void start() = 0;
+    virtual void stop() = 0;
+
+    /* called from the io writer only; msgs are released by io afterwards */
+    virtual void send(struct nl_msg **msgs, size_t num) = 0;
+
+    /* take back a frame message passed to io::deliver_frame(); false if the
+     * message is not one of ours
+     */
+    virtual bool release(struct nl_msg *msg)
+    {
+        return false;
+    }
+
+    /* true if msg is a frame message still pointing into backend memory */
+    virtual bool pinned(struct nl_msg *msg)
+    {
+        return false;
+    }
+};
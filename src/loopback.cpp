@@ -0,0 +1,186 @@
+#include <netlink/genl/genl.h>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <functional>
+#include <cstring>
+
+#include "logging.hpp"
+#include "frame.hpp"
+#include "msg_pool.hpp"
+#include "io.hpp"
+#include "loopback.hpp"
+
+DECLARE_int32(e3);
+
+/* interface index reported to io at registration */
+#define LOOPBACK_IFINDEX 1
+
+static const uint8_t loopback_src[ETH_ALEN] = {0x02, 0, 0, 0, 0, 0x01};
+static const uint8_t loopback_dst[ETH_ALEN] = {0x02, 0, 0, 0, 0, 0x02};
+
+loopback::loopback(int erasure, size_t inbox_size)
+    : m_inbox(inbox_size),
+      m_percent(0, 99),
+      m_erasure(erasure < 0 ? FLAGS_e3 : erasure)
+{
+    counters_group("loopback");
+}
+
+loopback::~loopback()
+{
+    struct nl_msg *msg;
+
+    if (m_loop)
+        m_loop->remove(m_event);
+
+    while (m_inbox.pop(msg))
+        nlmsg_free(msg);
+}
+
+void loopback::open()
+{
+    m_loop = m_io->loop();
+    m_event = m_loop->add_event(std::bind(&loopback::receive_ready, this),
+                                m_io->read_group());
+}
+
+/* Answer our own registration like the kernel would */
+void loopback::register_node()
+{
+    struct nl_msg *msg = m_io->rx_buffer(NLMSG_HDRLEN + GENL_HDRLEN + 64);
+
+    msg_pool::reset(msg);
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_REGISTER, 1));
+    CHECK_EQ(nla_put_u32(msg, BATADV_HLP_A_IFINDEX, LOOPBACK_IFINDEX), 0);
+
+    CHECK(m_inbox.push(msg)) << "loopback: Inbox full at registration";
+    m_loop->notify(m_event);
+}
+
+void loopback::start()
+{}
+
+void loopback::stop()
+{}
+
+bool loopback::inject(const uint8_t *data, size_t len)
+{
+    struct nl_msg *msg;
+
+    if (m_blocked)
+        return false;
+
+    msg = m_io->rx_buffer(NLMSG_HDRLEN + GENL_HDRLEN + len + 64);
+    msg_pool::reset(msg);
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_FRAME, 1));
+    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, PLAIN_PACKET), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, loopback_src), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, loopback_dst), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_FRAME, len, data), 0);
+
+    if (!m_inbox.push(msg)) {
+        counters_increment("overrun");
+        m_io->free_msg(msg);
+        return false;
+    }
+
+    m_loop->notify(m_event);
+
+    return true;
+}
+
+/* Copy a frame from the peer into one of our receive buffers */
+bool loopback::receive(struct nlmsghdr *nlh)
+{
+    struct nl_msg *msg = m_io->rx_buffer(nlh->nlmsg_len);
+
+    memcpy(nlmsg_hdr(msg), nlh, nlh->nlmsg_len);
+
+    if (!m_inbox.push(msg)) {
+        counters_increment("overrun");
+        m_io->free_msg(msg);
+        return false;
+    }
+
+    return true;
+}
+
+void loopback::receive_ready()
+{
+    struct nl_msg *msg;
+
+    while (m_inbox.pop(msg))
+        m_io->deliver(msg);
+}
+
+bool loopback::erase()
+{
+    return m_erasure && m_percent(m_rand) < m_erasure;
+}
+
+void loopback::send(struct nl_msg **msgs, size_t num)
+{
+    struct nlattr *attrs[BATADV_HLP_A_NUM];
+    struct genlmsghdr *gnlh;
+    struct nlmsghdr *nlh;
+    pointer peer = m_peer.lock();
+    size_t received = 0;
+
+    for (size_t i = 0; i < num; ++i) {
+        nlh = nlmsg_hdr(msgs[i]);
+        gnlh = static_cast<struct genlmsghdr *>(nlmsg_data(nlh));
+
+        switch (gnlh->cmd) {
+            case BATADV_HLP_C_BLOCK:
+                counters_increment("block");
+                m_blocked = true;
+                continue;
+
+            case BATADV_HLP_C_UNBLOCK:
+                m_blocked = false;
+                continue;
+
+            case BATADV_HLP_C_FRAME:
+                break;
+
+            default:
+                continue;
+        }
+
+        genlmsg_parse(nlh, 0, attrs, BATADV_HLP_A_MAX, NULL);
+        struct frame f(msgs[i], attrs);
+
+        switch (f.type) {
+            case DEC_PACKET:
+                counters_increment("dec");
+                if (m_sink)
+                    m_sink(f.data, f.len);
+                continue;
+
+            case ENC_PACKET:
+            case REQ_PACKET:
+            case ACK_PACKET:
+                break;
+
+            default:
+                counters_increment("unrouted");
+                continue;
+        }
+
+        if (!peer)
+            continue;
+
+        if (erase()) {
+            counters_increment("erased");
+            continue;
+        }
+
+        received += peer->receive(nlh) ? 1 : 0;
+    }
+
+    /* one wakeup of the peer for the whole batch */
+    if (received)
+        peer->m_loop->notify(peer->m_event);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <netlink/netlink.h>
+#include <functional>
+#include <memory>
+#include <random>
+#include <atomic>
+
+#include "io_backend.hpp"
+#include "ring_queue.hpp"
+#include "reactor.hpp"
+#include "counters.hpp"
+
+/* In-memory backend connecting two io instances in one process. ENC, REQ
+ * and ACK frames sent by one side are copied into receive buffers of the
+ * other side and delivered from its reactor, erased with a configurable
+ * probability on the way. The two nodes only share the direct source to
+ * destination link, so the probability defaults to --e3, which the encoder
+ * budget is computed from. DEC frames leave through a sink callback, and
+ * plain frames enter with inject(), like they would from the kernel.
+ */
+class loopback : public io_backend, public counters_api
+{
+  public:
+    typedef std::shared_ptr<loopback> pointer;
+    typedef std::function<void(const uint8_t *data, size_t len)> sink;
+
+  private:
+    std::weak_ptr<loopback> m_peer;
+    ring_queue<struct nl_msg *> m_inbox;
+    reactor::pointer m_loop;
+    int m_event = {-1};
+    std::atomic<bool> m_blocked = {false};
+    std::mt19937 m_rand;
+    std::uniform_int_distribution<size_t> m_percent;
+    size_t m_erasure;
+    sink m_sink;
+
+    bool receive(struct nlmsghdr *nlh);
+    void receive_ready();
+    bool erase();
+
+  public:
+    /* erasure in percent, or negative for --e3 */
+    loopback(int erasure, size_t inbox_size);
+    ~loopback();
+
+    static void connect(pointer a, pointer b)
+    {
+        a->m_peer = b;
+        b->m_peer = a;
+    }
+
+    void set_sink(sink s)
+    {
+        m_sink = s;
+    }
+
+    bool blocked() const
+    {
+        return m_blocked;
+    }
+
+    /* hand a plain frame to our own io; false if the encoders are blocked */
+    bool inject(const uint8_t *data, size_t len);
+
+    void open();
+    void register_node();
+    void start();
+    void stop();
+    void send(struct nl_msg **msgs, size_t num);
+};
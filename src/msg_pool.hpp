@@ -0,0 +1,192 @@
+#pragma once
+
+#include <netlink/netlink.h>
+#include <netlink/msg.h>
+#include <glog/logging.h>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "counters.hpp"
+
+/* number of messages moved between a cache and the shared pool at a time */
+#define MSG_POOL_BATCH 32
+
+class msg_pool : public counters_api
+{
+    std::vector<struct nl_msg *> m_msgs;
+    std::mutex m_lock;
+    size_t m_msg_size, m_capacity;
+
+  public:
+    typedef std::shared_ptr<msg_pool> pointer;
+
+    /* Per-thread front end of the pool. Messages are taken from and returned
+     * to a local list, and only whole batches are exchanged with the shared
+     * pool, so the owning thread rarely touches the pool lock. A cache must
+     * only be used from one thread at a time.
+     */
+    class cache
+    {
+        msg_pool::pointer m_pool;
+        std::vector<struct nl_msg *> m_msgs;
+        size_t m_hits = {0}, m_misses = {0};
+
+        void flush(size_t keep)
+        {
+            if (!m_pool)
+                return;
+
+            m_pool->put(m_msgs, keep);
+            m_pool->account(m_hits, m_misses);
+            m_hits = 0;
+            m_misses = 0;
+        }
+
+      public:
+        ~cache()
+        {
+            flush(0);
+        }
+
+        void pool(msg_pool::pointer pool)
+        {
+            if (pool == m_pool)
+                return;
+
+            flush(0);
+            m_pool = pool;
+        }
+
+        struct nl_msg *alloc()
+        {
+            struct nl_msg *msg;
+
+            if (!m_pool)
+                return nlmsg_alloc();
+
+            if (m_msgs.empty()) {
+                m_pool->get(m_msgs, MSG_POOL_BATCH);
+                m_pool->account(m_hits, m_misses);
+                m_hits = 0;
+                m_misses = 0;
+            }
+
+            if (m_msgs.empty()) {
+                m_misses++;
+                return m_pool->create();
+            }
+
+            m_hits++;
+            msg = m_msgs.back();
+            m_msgs.pop_back();
+
+            return msg;
+        }
+
+        void release(struct nl_msg *msg)
+        {
+            if (!m_pool || !m_pool->fits(msg)) {
+                nlmsg_free(msg);
+                return;
+            }
+
+            reset(msg);
+            m_msgs.push_back(msg);
+
+            if (m_msgs.size() >= 2*MSG_POOL_BATCH)
+                flush(MSG_POOL_BATCH);
+        }
+    };
+
+    msg_pool(size_t msg_size, size_t capacity)
+        : m_msg_size(msg_size),
+          m_capacity(capacity)
+    {
+        counters_group("pool");
+        m_msgs.reserve(capacity);
+
+        for (size_t i = 0; i < capacity; ++i)
+            m_msgs.push_back(CHECK_NOTNULL(create()));
+    }
+
+    ~msg_pool()
+    {
+        for (auto msg : m_msgs)
+            nlmsg_free(msg);
+    }
+
+    static void reset(struct nl_msg *msg)
+    {
+        struct nlmsghdr *nlh = nlmsg_hdr(msg);
+
+        memset(nlh, 0, NLMSG_HDRLEN);
+        nlh->nlmsg_len = NLMSG_HDRLEN;
+    }
+
+    struct nl_msg *create()
+    {
+        return nlmsg_alloc_size(m_msg_size);
+    }
+
+    bool fits(struct nl_msg *msg) const
+    {
+        return nlmsg_get_max_size(msg) == m_msg_size;
+    }
+
+    /* move up to num messages from the pool to msgs */
+    void get(std::vector<struct nl_msg *> &msgs, size_t num)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        while (num-- && !m_msgs.empty()) {
+            msgs.push_back(m_msgs.back());
+            m_msgs.pop_back();
+        }
+    }
+
+    /* move all but keep messages from msgs to the pool */
+    void put(std::vector<struct nl_msg *> &msgs, size_t keep)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        while (msgs.size() > keep) {
+            if (m_msgs.size() < m_capacity)
+                m_msgs.push_back(msgs.back());
+            else
+                nlmsg_free(msgs.back());
+
+            msgs.pop_back();
+        }
+    }
+
+    /* locked allocation for threads without a cache */
+    struct nl_msg *alloc()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        struct nl_msg *msg;
+
+        if (m_msgs.empty()) {
+            lock.unlock();
+            counters_increment("miss");
+            return create();
+        }
+
+        msg = m_msgs.back();
+        m_msgs.pop_back();
+        lock.unlock();
+        counters_increment("hit");
+
+        return msg;
+    }
+
+    void account(size_t hits, size_t misses)
+    {
+        if (hits)
+            counters_add("hit", hits);
+
+        if (misses)
+            counters_add("miss", misses);
+    }
+};
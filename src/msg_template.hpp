@@ -0,0 +1,62 @@
+#pragma once
+
+#include <netlink/netlink.h>
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+#include <netlink/genl/genl.h>
+#include <glog/logging.h>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+/* Genl header and attributes of an outgoing frame that stay the same for a
+ * generation, captured from a message built with the usual nla_put() calls
+ * and copied into new messages with a single memcpy(). Attributes that do
+ * vary are patched in place by their offset in the template.
+ */
+class msg_template
+{
+    std::vector<uint8_t> m_data;
+
+  public:
+    void capture(struct nl_msg *msg)
+    {
+        uint8_t *nlh = reinterpret_cast<uint8_t *>(nlmsg_hdr(msg));
+
+        m_data.assign(nlh, nlh + nlmsg_hdr(msg)->nlmsg_len);
+    }
+
+    void clear()
+    {
+        m_data.clear();
+    }
+
+    bool empty() const
+    {
+        return m_data.empty();
+    }
+
+    /* overwrite msg with the template; attributes can be added after it */
+    void stamp(struct nl_msg *msg) const
+    {
+        memcpy(nlmsg_hdr(msg), &m_data[0], m_data.size());
+    }
+
+    /* offset of the payload of an attribute from the start of the message */
+    size_t offset(int attrtype)
+    {
+        struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(&m_data[0]);
+        struct nlattr *attr = nlmsg_find_attr(nlh, GENL_HDRLEN, attrtype);
+
+        CHECK_NOTNULL(attr);
+
+        return static_cast<uint8_t *>(nla_data(attr)) - &m_data[0];
+    }
+
+    template<typename T>
+    static void patch(struct nl_msg *msg, size_t offset, T val)
+    {
+        memcpy(reinterpret_cast<uint8_t *>(nlmsg_hdr(msg)) + offset, &val,
+               sizeof(val));
+    }
+};
@@ -0,0 +1,462 @@
+#include <netlink/genl/genl.h>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <unistd.h>
+#include <functional>
+#include <cstring>
+
+#include "logging.hpp"
+#include "msg_pool.hpp"
+#include "io.hpp"
+#include "packet_ring.hpp"
+
+DECLARE_int32(packet_blocks);
+DECLARE_int32(packet_block_size);
+DECLARE_int32(packet_timeout);
+
+/* IEEE 802 local experimental ethertype */
+#define ETH_P_RLNC 0x88b5
+
+/* slot size in both rings; holds a full ethernet frame and its headers */
+#define PACKET_FRAME_SIZE 2048
+
+/* size of the descriptor messages, telling them apart from other messages */
+#define PACKET_DESC_SIZE 32
+
+/* attribute headers and addresses besides the payload of a copied frame */
+#define PACKET_ATTR_ROOM 128
+
+/* offset of the frame data in a tx slot */
+#define PACKET_TX_OFFSET (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+static const uint8_t packet_bcast[ETH_ALEN] = {0xff, 0xff, 0xff,
+                                               0xff, 0xff, 0xff};
+
+packet_ring::packet_ring(const std::string &ifname, size_t pinned)
+    : m_ifname(ifname),
+      m_desc_free(pinned)
+{
+    struct nl_msg *msg;
+
+    counters_group("packet");
+
+    for (size_t i = 0; i < pinned; ++i) {
+        msg = CHECK_NOTNULL(nlmsg_alloc_size(PACKET_DESC_SIZE));
+        nlmsg_hdr(msg)->nlmsg_pid = i;
+        m_descs.push_back(msg);
+        m_desc_free.push(msg);
+    }
+}
+
+/* io outlives its coders, so every descriptor is back by now */
+packet_ring::~packet_ring()
+{
+    if (m_loop && m_sock >= 0)
+        m_loop->remove(m_sock);
+
+    if (m_map)
+        munmap(m_map, m_map_size);
+
+    if (m_sock >= 0)
+        close(m_sock);
+
+    for (auto msg : m_descs)
+        nlmsg_free(msg);
+}
+
+void packet_ring::setup_ring(int opt, size_t blocks, unsigned int timeout)
+{
+    struct tpacket_req3 req;
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = FLAGS_packet_block_size;
+    req.tp_block_nr = blocks;
+    req.tp_frame_size = PACKET_FRAME_SIZE;
+    req.tp_frame_nr = FLAGS_packet_block_size / PACKET_FRAME_SIZE * blocks;
+    req.tp_retire_blk_tov = timeout;
+
+    PCHECK(setsockopt(m_sock, SOL_PACKET, opt, &req, sizeof(req)) == 0)
+        << "packet: Failed to set up ring on " << m_ifname;
+}
+
+void packet_ring::open()
+{
+    size_t blocks = FLAGS_packet_blocks, ring_size, frames;
+    struct sockaddr_ll addr;
+    struct ifreq ifr;
+    int val;
+
+    CHECK_EQ(FLAGS_packet_block_size % getpagesize(), 0)
+        << "packet: Block size must be a multiple of the page size";
+    CHECK_EQ(FLAGS_packet_block_size % PACKET_FRAME_SIZE, 0)
+        << "packet: Block size must be a multiple of "
+        << PACKET_FRAME_SIZE;
+
+    m_loop = m_io->loop();
+    m_ifindex = if_nametoindex(m_ifname.c_str());
+    PCHECK(m_ifindex) << "packet: Unknown interface " << m_ifname;
+
+    m_sock = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    htons(ETH_P_RLNC));
+    PCHECK(m_sock >= 0) << "packet: Failed to create socket";
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, m_ifname.c_str(), IFNAMSIZ - 1);
+    PCHECK(ioctl(m_sock, SIOCGIFHWADDR, &ifr) == 0)
+        << "packet: Failed to get address of " << m_ifname;
+    memcpy(m_addr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    val = TPACKET_V3;
+    PCHECK(setsockopt(m_sock, SOL_PACKET, PACKET_VERSION, &val,
+                      sizeof(val)) == 0) << "packet: TPACKET_V3 unsupported";
+
+    setup_ring(PACKET_RX_RING, blocks, FLAGS_packet_timeout);
+    setup_ring(PACKET_TX_RING, blocks, 0);
+
+    /* we do our own batching; skip the qdisc layer if the kernel lets us */
+    val = 1;
+    if (setsockopt(m_sock, SOL_PACKET, PACKET_QDISC_BYPASS, &val,
+                   sizeof(val)) < 0)
+        VLOG(LOG_IO) << "packet: qdisc bypass unavailable";
+
+    ring_size = blocks * FLAGS_packet_block_size;
+    m_map_size = 2 * ring_size;
+    m_map = static_cast<uint8_t *>(mmap(NULL, m_map_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE,
+                                        m_sock, 0));
+    PCHECK(m_map != MAP_FAILED) << "packet: Failed to map rings";
+
+    m_rx_refs.reset(new std::atomic<int>[blocks]);
+    for (size_t i = 0; i < blocks; ++i) {
+        m_rx_blocks.push_back(m_map + i * FLAGS_packet_block_size);
+        m_rx_refs[i] = 0;
+    }
+
+    frames = ring_size / PACKET_FRAME_SIZE;
+    for (size_t i = 0; i < frames; ++i)
+        m_tx_slots.push_back(m_map + ring_size + i * PACKET_FRAME_SIZE);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_RLNC);
+    addr.sll_ifindex = m_ifindex;
+    PCHECK(bind(m_sock, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof(addr)) == 0) << "packet: Failed to bind " << m_ifname;
+
+    m_loop->add_fd(m_sock, std::bind(&packet_ring::rx_ready, this),
+                   m_io->read_group());
+
+    LOG(INFO) << "packet: " << blocks << " blocks of "
+              << FLAGS_packet_block_size << " bytes on " << m_ifname;
+}
+
+/* Answer our own registration like the kernel would */
+void packet_ring::register_node()
+{
+    struct nl_msg *msg = m_io->rx_buffer(NLMSG_HDRLEN + GENL_HDRLEN + 64);
+
+    msg_pool::reset(msg);
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_REGISTER, 1));
+    CHECK_EQ(nla_put_u32(msg, BATADV_HLP_A_IFINDEX, m_ifindex), 0);
+
+    m_io->deliver(msg);
+}
+
+void packet_ring::start()
+{}
+
+void packet_ring::stop()
+{}
+
+void packet_ring::rx_ready()
+{
+    struct tpacket_block_desc *bd;
+
+    while (true) {
+        bd = reinterpret_cast<struct tpacket_block_desc *>(
+                m_rx_blocks[m_rx_next]);
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+              TP_STATUS_USER))
+            break;
+
+        /* a block still referenced after a full lap was never handed
+         * back, so its frames were walked already; wait for the last
+         * frame to be released instead of delivering them again
+         */
+        if (m_rx_refs[m_rx_next].load(std::memory_order_acquire)) {
+            counters_increment("rx block held");
+            break;
+        }
+
+        /* the kernel fills the blocks in order and stops at one still
+         * pinned by a frame in flight, so once such a block is less than
+         * half the ring ahead the frames of this one are copied
+         */
+        m_rx_copy = pinned_ahead(m_rx_next);
+
+        /* the reader holds its own reference while walking the block */
+        m_rx_refs[m_rx_next].fetch_add(1, std::memory_order_acq_rel);
+        walk_block(m_rx_next);
+        put_block(m_rx_next);
+        counters_increment("rx block");
+
+        m_rx_next = (m_rx_next + 1) % m_rx_blocks.size();
+    }
+}
+
+void packet_ring::walk_block(size_t block)
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *hdr;
+    uint8_t *base = m_rx_blocks[block];
+
+    bd = reinterpret_cast<struct tpacket_block_desc *>(base);
+    hdr = reinterpret_cast<struct tpacket3_hdr *>(
+            base + bd->hdr.bh1.offset_to_first_pkt);
+
+    for (uint32_t i = 0; i < bd->hdr.bh1.num_pkts; ++i) {
+        receive(block, reinterpret_cast<uint8_t *>(hdr) + hdr->tp_mac,
+                hdr->tp_snaplen);
+        hdr = reinterpret_cast<struct tpacket3_hdr *>(
+                reinterpret_cast<uint8_t *>(hdr) + hdr->tp_next_offset);
+    }
+}
+
+/* Hand the block back to the kernel when its last reference goes */
+void packet_ring::put_block(size_t block)
+{
+    struct tpacket_block_desc *bd;
+
+    if (m_rx_refs[block].fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    bd = reinterpret_cast<struct tpacket_block_desc *>(m_rx_blocks[block]);
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+}
+
+bool packet_ring::pinned_ahead(size_t block)
+{
+    size_t num = m_rx_blocks.size();
+
+    for (size_t i = 1; i <= num / 2; ++i)
+        if (m_rx_refs[(block + i) % num].load(std::memory_order_relaxed))
+            return true;
+
+    return false;
+}
+
+void packet_ring::receive(size_t block, uint8_t *pkt, size_t len)
+{
+    struct ethhdr *eth = reinterpret_cast<struct ethhdr *>(pkt);
+    struct frame_hdr *hdr = reinterpret_cast<struct frame_hdr *>(eth + 1);
+    struct frame f;
+
+    if (len < sizeof(*eth) + sizeof(*hdr)) {
+        counters_increment("rx short");
+        return;
+    }
+
+    f.type = hdr->type;
+    f.uid = ntohs(hdr->uid);
+    f.rank = ntohs(hdr->rank);
+    f.seq = ntohs(hdr->seq);
+    f.data = reinterpret_cast<uint8_t *>(hdr + 1);
+    f.len = len - sizeof(*eth) - sizeof(*hdr);
+    f.src = eth->h_source;
+    f.dst = eth->h_dest;
+
+    if (!m_io->frame_valid(f.type, f.len)) {
+        counters_increment("rx invalid");
+        return;
+    }
+
+    /* like the kernel, drop plain frames while the encoders are full */
+    if (f.type == PLAIN_PACKET && m_blocked) {
+        counters_increment("rx drop");
+        return;
+    }
+
+    counters_increment("rx");
+
+    if (m_rx_copy) {
+        counters_increment("rx copy lap");
+        deliver_copy(f);
+        return;
+    }
+
+    /* out of descriptors means the coders hold on to many frames; copy
+     * instead of pinning even more of the ring
+     */
+    if (!m_desc_free.pop(f.msg)) {
+        counters_increment("rx copy");
+        deliver_copy(f);
+        return;
+    }
+
+    nlmsg_hdr(f.msg)->nlmsg_seq = block;
+    m_rx_refs[block].fetch_add(1, std::memory_order_relaxed);
+    m_io->deliver_frame(f);
+}
+
+void packet_ring::deliver_copy(const struct frame &f)
+{
+    struct nl_msg *msg;
+
+    msg = m_io->rx_buffer(NLMSG_HDRLEN + GENL_HDRLEN + f.len +
+                          PACKET_ATTR_ROOM);
+    msg_pool::reset(msg);
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_FRAME, 1));
+    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, f.type), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, f.src), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, f.dst), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_BLOCK, f.uid), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_RANK, f.rank), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_SEQ, f.seq), 0);
+
+    if (f.len)
+        CHECK_EQ(nla_put(msg, BATADV_HLP_A_FRAME, f.len, f.data), 0);
+
+    m_io->deliver(msg);
+}
+
+bool packet_ring::pinned(struct nl_msg *msg)
+{
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+
+    return nlmsg_get_max_size(msg) == PACKET_DESC_SIZE &&
+           nlh->nlmsg_pid < m_descs.size() && m_descs[nlh->nlmsg_pid] == msg;
+}
+
+bool packet_ring::release(struct nl_msg *msg)
+{
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+
+    if (!pinned(msg))
+        return false;
+
+    put_block(nlh->nlmsg_seq);
+    m_desc_free.push(msg);
+
+    return true;
+}
+
+/* Fill the next tx slot; false if the frame could not be queued */
+bool packet_ring::write_slot(const struct frame &f)
+{
+    uint8_t *slot = m_tx_slots[m_tx_next];
+    struct tpacket3_hdr *th = reinterpret_cast<struct tpacket3_hdr *>(slot);
+    struct ethhdr *eth;
+    struct frame_hdr *hdr;
+    size_t len = sizeof(*eth) + sizeof(*hdr) + f.len;
+
+    if (len > PACKET_FRAME_SIZE - PACKET_TX_OFFSET) {
+        counters_increment("tx oversize");
+        return false;
+    }
+
+    /* let the kernel catch up once before giving up on a full ring */
+    if (__atomic_load_n(&th->tp_status, __ATOMIC_ACQUIRE) !=
+        TP_STATUS_AVAILABLE) {
+        kick();
+
+        if (__atomic_load_n(&th->tp_status, __ATOMIC_ACQUIRE) !=
+            TP_STATUS_AVAILABLE) {
+            counters_increment("tx ring full");
+            m_io->set_congested();
+            return false;
+        }
+    }
+
+    eth = reinterpret_cast<struct ethhdr *>(slot + PACKET_TX_OFFSET);
+    memcpy(eth->h_dest, f.dst ? f.dst : packet_bcast, ETH_ALEN);
+    memcpy(eth->h_source, m_addr, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_RLNC);
+
+    hdr = reinterpret_cast<struct frame_hdr *>(eth + 1);
+    hdr->type = f.type;
+    hdr->reserved = 0;
+    hdr->uid = htons(f.uid);
+    hdr->rank = htons(f.rank);
+    hdr->seq = htons(f.seq);
+
+    if (f.len)
+        memcpy(hdr + 1, f.data, f.len);
+
+    th->tp_len = len;
+    __atomic_store_n(&th->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    m_tx_next = (m_tx_next + 1) % m_tx_slots.size();
+
+    return true;
+}
+
+void packet_ring::kick()
+{
+    if (::send(m_sock, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+        errno != ENOBUFS)
+        PLOG(ERROR) << "packet: Failed to flush tx ring";
+
+    counters_increment("tx kick");
+}
+
+void packet_ring::send(struct nl_msg **msgs, size_t num)
+{
+    struct nlattr *attrs[BATADV_HLP_A_NUM];
+    struct genlmsghdr *gnlh;
+    struct nlmsghdr *nlh;
+    size_t queued = 0;
+
+    for (size_t i = 0; i < num; ++i) {
+        nlh = nlmsg_hdr(msgs[i]);
+        gnlh = static_cast<struct genlmsghdr *>(nlmsg_data(nlh));
+
+        switch (gnlh->cmd) {
+            case BATADV_HLP_C_BLOCK:
+                counters_increment("block");
+                m_blocked = true;
+                continue;
+
+            case BATADV_HLP_C_UNBLOCK:
+                m_blocked = false;
+                continue;
+
+            case BATADV_HLP_C_FRAME:
+                break;
+
+            default:
+                continue;
+        }
+
+        genlmsg_parse(nlh, 0, attrs, BATADV_HLP_A_MAX, NULL);
+        struct frame f(msgs[i], attrs);
+
+        switch (f.type) {
+            case ENC_PACKET:
+            case REQ_PACKET:
+            case ACK_PACKET:
+            case DEC_PACKET:
+                break;
+
+            default:
+                counters_increment("unrouted");
+                continue;
+        }
+
+        queued += write_slot(f) ? 1 : 0;
+    }
+
+    /* one syscall for the whole batch */
+    if (queued)
+        kick();
+
+    counters_add("tx", queued);
+}
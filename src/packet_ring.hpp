@@ -0,0 +1,78 @@
+#pragma once
+
+#include <netlink/netlink.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "io_backend.hpp"
+#include "ring_queue.hpp"
+#include "reactor.hpp"
+#include "frame.hpp"
+#include "counters.hpp"
+
+/* Backend exchanging frames as raw ethernet frames on an interface through
+ * mmap'ed TPACKET_V3 rings. Every frame, plain and decoded ones included,
+ * carries a frame_hdr behind an ethernet header of type ETH_P_RLNC.
+ *
+ * Received frames are handed to io in place: the frame data points into the
+ * rx ring block, and f.msg is a small descriptor that pins the block until
+ * it comes back through release(). Blocks are handed back in ring order,
+ * so frames are copied instead while a pinned block is coming close to the
+ * kernel again, and holders that may keep a frame for long copy it out
+ * with io::detach_frame(). Frames to send are written straight into
+ * tx ring slots and the kernel is kicked once per batch.
+ */
+class packet_ring : public io_backend, public counters_api
+{
+    std::string m_ifname;
+    reactor::pointer m_loop;
+    int m_sock = {-1};
+    uint32_t m_ifindex = {0};
+    uint8_t m_addr[ETH_ALEN];
+    std::atomic<bool> m_blocked = {false};
+
+    /* rx and tx rings share one mapping, rx first */
+    uint8_t *m_map = {NULL};
+    size_t m_map_size = {0};
+
+    /* rx blocks, each pinned by the reader and by every frame in flight */
+    std::vector<uint8_t *> m_rx_blocks;
+    std::unique_ptr<std::atomic<int>[]> m_rx_refs;
+    size_t m_rx_next = {0};
+    bool m_rx_copy = {false};
+
+    /* descriptors handed out as frame messages */
+    std::vector<struct nl_msg *> m_descs;
+    ring_queue<struct nl_msg *> m_desc_free;
+
+    std::vector<uint8_t *> m_tx_slots;
+    size_t m_tx_next = {0};
+
+    void setup_ring(int opt, size_t blocks, unsigned int timeout);
+    void rx_ready();
+    void walk_block(size_t block);
+    void put_block(size_t block);
+    bool pinned_ahead(size_t block);
+    void receive(size_t block, uint8_t *pkt, size_t len);
+    void deliver_copy(const struct frame &f);
+    bool write_slot(const struct frame &f);
+    void kick();
+
+  public:
+    typedef std::shared_ptr<packet_ring> pointer;
+
+    packet_ring(const std::string &ifname, size_t pinned);
+    ~packet_ring();
+
+    void open();
+    void register_node();
+    void start();
+    void stop();
+    void send(struct nl_msg **msgs, size_t num);
+    bool release(struct nl_msg *msg);
+    bool pinned(struct nl_msg *msg);
+};
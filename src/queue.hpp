@@ -3,6 +3,8 @@
 #include <netlink/netlink.h>
 #include <glog/logging.h>
 #include <atomic>
+#include <chrono>
+#include <mutex>
 #include <deque>
 #include <queue>
 
@@ -79,6 +81,18 @@ class prio_queue
         return m_size == 0;
     }
 
+    /* exchange the contents in O(1), so a consumer can take all pending
+     * entries while holding the producer lock only briefly
+     */
+    void swap(prio_queue &oth)
+    {
+        size_t size = m_size;
+
+        m_queues.swap(oth.m_queues);
+        m_size = oth.m_size.load();
+        oth.m_size = size;
+    }
+
     void clear()
     {
         typename Outer::iterator it;
@@ -194,3 +208,19 @@ class prio_queue
         return iterator(m_queues.rend(), m_queues.rend());
     }
 };
+
+/* Take lock, returning the nanoseconds spent blocked on another holder */
+template<typename Mutex>
+uint64_t lock_stalled(std::unique_lock<Mutex> &lock)
+{
+    std::chrono::steady_clock::time_point start;
+
+    if (lock.try_lock())
+        return 0;
+
+    start = std::chrono::steady_clock::now();
+    lock.lock();
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+}
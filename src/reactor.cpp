@@ -0,0 +1,561 @@
+#include <glog/logging.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <functional>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+
+#include "logging.hpp"
+#include "reactor.hpp"
+
+#define REACTOR_EVENTS 16
+
+/* the reactor and ready list of the calling thread, if it is a reactor one */
+static thread_local const void *t_reactor = NULL;
+static thread_local void *t_worker = NULL;
+
+reactor::reactor(size_t threads, const std::string &cpus)
+{
+    /* level triggered and never re-armed, so it wakes every thread */
+    m_stop = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    PCHECK(m_stop >= 0) << "reactor: Failed to create stop event";
+
+    counters_group("reactor");
+    add_coder_groups(threads, cpus);
+}
+
+/* Split the coder CPUs into a group per NUMA node; threads are shared out
+ * by the number of CPUs of each node, and a single thread keeps them all
+ */
+void reactor::add_coder_groups(size_t threads, const std::string &cpus)
+{
+    std::map<int, std::string> nodes;
+    std::map<int, size_t> counts;
+    size_t grp, num, total = 0;
+    std::string name;
+    cpu_set_t set;
+    int node;
+
+    parse_cpus(cpus, &set);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+
+        node = cpu_node(cpu);
+        nodes[node] += (nodes[node].empty() ? "" : ",") + std::to_string(cpu);
+        counts[node]++;
+        total++;
+    }
+
+    if (nodes.size() <= 1 || threads == 1) {
+        grp = add_group("work", threads, cpus);
+        m_groups[grp]->node = nodes.size() == 1 ? nodes.begin()->first : -1;
+        m_coder_groups.push_back(grp);
+        return;
+    }
+
+    for (auto &n : nodes) {
+        num = threads ? std::max<size_t>(threads * counts[n.first] / total, 1)
+                      : 0;
+        name = m_coder_groups.empty() ? "work"
+                                      : "work node" + std::to_string(n.first);
+        grp = add_group(name, num, n.second);
+        m_groups[grp]->node = n.first;
+        m_coder_groups.push_back(grp);
+    }
+}
+
+int reactor::cpu_node(int cpu)
+{
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    struct dirent *ent;
+    int node = -1;
+    DIR *dir;
+
+    dir = opendir(path.c_str());
+    if (!dir)
+        return -1;
+
+    /* the cpu directory links to its node as nodeN */
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "node", 4) == 0 &&
+            isdigit(ent->d_name[4])) {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(dir);
+
+    return node;
+}
+
+reactor::~reactor()
+{
+    stop();
+
+    for (auto &h : m_handlers)
+        if (h.second->owned)
+            close(h.first);
+
+    for (auto &g : m_groups) {
+        close(g->kick);
+        close(g->epoll);
+    }
+
+    close(m_stop);
+}
+
+void reactor::parse_cpus(const std::string &list, cpu_set_t *set)
+{
+    const char *s = list.c_str();
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+
+    while (*s) {
+        first = last = strtol(s, &end, 10);
+        CHECK(end != s && first >= 0) << "reactor: Invalid CPU list " << list;
+
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            CHECK(end != s && last >= first)
+                << "reactor: Invalid CPU list " << list;
+        }
+
+        CHECK_LT(last, CPU_SETSIZE) << "reactor: Invalid CPU list " << list;
+
+        for (long cpu = first; cpu <= last; ++cpu)
+            CPU_SET(cpu, set);
+
+        CHECK(*end == ',' || *end == '\0')
+            << "reactor: Invalid CPU list " << list;
+        s = *end ? end + 1 : end;
+    }
+}
+
+size_t reactor::add_group(const std::string &name, size_t threads,
+                          const std::string &cpus)
+{
+    std::unique_ptr<group> g(new group);
+    struct epoll_event ev;
+    std::vector<int> list;
+    cpu_set_t set;
+
+    CHECK(!m_running) << "reactor: Groups must be added before start";
+
+    parse_cpus(cpus, &set);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &set))
+            list.push_back(cpu);
+
+    if (!threads)
+        threads = list.size() ? list.size() :
+                                std::thread::hardware_concurrency();
+
+    threads = std::max<size_t>(threads, 1);
+    g->name = name;
+
+    for (size_t i = 0; i < threads; ++i) {
+        g->workers.emplace_back(new worker);
+
+        if (list.empty())
+            continue;
+
+        /* a single thread may use the whole set, several get a CPU each */
+        if (threads > 1) {
+            CPU_ZERO(&set);
+            CPU_SET(list[i % list.size()], &set);
+        }
+
+        g->cpus.push_back(set);
+    }
+
+    g->epoll = epoll_create1(EPOLL_CLOEXEC);
+    PCHECK(g->epoll >= 0) << "reactor: Failed to create epoll instance";
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = m_stop;
+    PCHECK(epoll_ctl(g->epoll, EPOLL_CTL_ADD, m_stop, &ev) == 0)
+        << "reactor: Failed to add stop event";
+
+    /* one shot, so each kick wakes a single idle thread */
+    g->kick = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    PCHECK(g->kick >= 0) << "reactor: Failed to create kick event";
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = g->kick;
+    PCHECK(epoll_ctl(g->epoll, EPOLL_CTL_ADD, g->kick, &ev) == 0)
+        << "reactor: Failed to add kick event";
+
+    m_groups.push_back(std::move(g));
+
+    return m_groups.size() - 1;
+}
+
+void reactor::start()
+{
+    if (m_running.exchange(true))
+        return;
+
+    for (auto &g : m_groups) {
+        for (size_t i = 0; i < g->workers.size(); ++i)
+            m_threads.emplace_back(std::bind(&reactor::thread_func, this,
+                                             g.get(), i));
+
+        VLOG(LOG_INIT) << "reactor started " << g->workers.size() << " "
+                       << g->name << " threads";
+    }
+}
+
+void reactor::stop()
+{
+    uint64_t val = 1;
+
+    if (!m_running.exchange(false))
+        return;
+
+    if (write(m_stop, &val, sizeof(val)) < 0)
+        PLOG(ERROR) << "reactor: Failed to signal stop";
+
+    for (auto &t : m_threads)
+        t.join();
+
+    m_threads.clear();
+
+    for (auto &g : m_groups)
+        for (auto &w : g->workers)
+            w->ready.clear();
+}
+
+int reactor::add(int fd, bool owned, callback cb, size_t grp)
+{
+    handler_ptr h(new handler);
+    struct epoll_event ev;
+
+    CHECK_LT(grp, m_groups.size()) << "reactor: Unknown group " << grp;
+
+    h->fd = fd;
+    h->owned = owned;
+    h->grp = m_groups[grp].get();
+    h->cb = cb;
+
+    std::lock_guard<std::mutex> lock(m_handlers_lock);
+    m_handlers[fd] = h;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = fd;
+    PCHECK(epoll_ctl(h->grp->epoll, EPOLL_CTL_ADD, fd, &ev) == 0)
+        << "reactor: Failed to add fd " << fd;
+
+    return fd;
+}
+
+int reactor::add_fd(int fd, callback cb, size_t grp)
+{
+    return add(fd, false, cb, grp);
+}
+
+int reactor::add_event(callback cb, size_t grp)
+{
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    PCHECK(fd >= 0) << "reactor: Failed to create eventfd";
+
+    return add(fd, true, cb, grp);
+}
+
+int reactor::add_timer(callback cb, size_t grp)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+    PCHECK(fd >= 0) << "reactor: Failed to create timerfd";
+
+    return add(fd, true, cb, grp);
+}
+
+void reactor::remove(int fd)
+{
+    handler_ptr h;
+
+    {
+        std::lock_guard<std::mutex> lock(m_handlers_lock);
+        auto it = m_handlers.find(fd);
+
+        if (it == m_handlers.end())
+            return;
+
+        h = it->second;
+        m_handlers.erase(it);
+    }
+
+    /* wait for a callback in progress before the fd goes away */
+    std::lock_guard<std::mutex> lock(h->lock);
+    h->removed = true;
+    epoll_ctl(h->grp->epoll, EPOLL_CTL_DEL, fd, NULL);
+
+    if (h->owned)
+        close(fd);
+}
+
+void reactor::notify(int fd)
+{
+    uint64_t val = 1;
+    handler_ptr h;
+
+    if (m_inline && t_reactor == this) {
+        {
+            std::lock_guard<std::mutex> lock(m_handlers_lock);
+            auto it = m_handlers.find(fd);
+
+            if (it != m_handlers.end())
+                h = it->second;
+        }
+
+        if (h) {
+            queue(static_cast<worker *>(t_worker), h);
+            return;
+        }
+    }
+
+    if (write(fd, &val, sizeof(val)) < 0)
+        PLOG(ERROR) << "reactor: Failed to notify fd " << fd;
+}
+
+void reactor::arm(int fd, duration timeout)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout);
+    struct itimerspec spec;
+
+    /* an all zero value would disarm the timer, so expire right away */
+    if (ns.count() <= 0)
+        ns = std::chrono::nanoseconds(1);
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = ns.count() / 1000000000;
+    spec.it_value.tv_nsec = ns.count() % 1000000000;
+
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0)
+        PLOG(ERROR) << "reactor: Failed to arm timer " << fd;
+}
+
+void reactor::disarm(int fd)
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0)
+        PLOG(ERROR) << "reactor: Failed to disarm timer " << fd;
+}
+
+void reactor::rearm(group *g, int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = fd;
+    PCHECK(epoll_ctl(g->epoll, EPOLL_CTL_MOD, fd, &ev) == 0)
+        << "reactor: Failed to re-arm fd " << fd;
+}
+
+void reactor::kick(group *g)
+{
+    if (g->idle)
+        notify(g->kick);
+}
+
+reactor::handler_ptr reactor::take(group *g, size_t id)
+{
+    size_t num = g->workers.size();
+    handler_ptr h;
+    size_t left;
+
+    {
+        std::lock_guard<std::mutex> lock(g->workers[id]->lock);
+        auto &ready = g->workers[id]->ready;
+
+        if (!ready.empty()) {
+            h = ready.front();
+            ready.pop_front();
+            return h;
+        }
+    }
+
+    /* out of work, so take the last queued handler of a busy thread */
+    for (size_t i = 1; i < num; ++i) {
+        worker *w = g->workers[(id + i) % num].get();
+        std::lock_guard<std::mutex> lock(w->lock);
+
+        if (w->ready.empty())
+            continue;
+
+        h = w->ready.back();
+        w->ready.pop_back();
+        left = w->ready.size();
+        m_steals++;
+
+        /* wake up one more thread if the victim is still backed up */
+        if (left > 1)
+            kick(g);
+
+        return h;
+    }
+
+    return h;
+}
+
+/* Put h on a ready list unless it is on one already */
+bool reactor::queue(worker *w, handler_ptr h)
+{
+    if (h->queued.exchange(true))
+        return false;
+
+    std::lock_guard<std::mutex> lock(w->lock);
+    w->ready.push_back(h);
+
+    return true;
+}
+
+void reactor::dispatch(handler_ptr h)
+{
+    uint64_t val;
+
+    std::lock_guard<std::mutex> lock(h->lock);
+
+    h->queued = false;
+
+    if (h->removed)
+        return;
+
+    /* reset the eventfd or timerfd counter; both read as 8 bytes, and only
+     * need it if epoll reported them rather than an inline notify()
+     */
+    if (!h->armed && h->owned && read(h->fd, &val, sizeof(val)) < 0 &&
+        errno != EAGAIN)
+        PLOG(ERROR) << "reactor: Failed to read fd " << h->fd;
+
+    h->cb();
+
+    if (!h->armed) {
+        h->armed = true;
+        rearm(h->grp, h->fd);
+    }
+}
+
+/* Pin the calling thread to its CPUs and record where it ended up */
+void reactor::place(group *g, size_t id)
+{
+    std::string name = g->name + " " + std::to_string(id);
+    unsigned cpu = 0, node = 0;
+    int err;
+
+    if (id < g->cpus.size()) {
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                     &g->cpus[id]);
+        LOG_IF(ERROR, err) << "reactor: Failed to pin " << name << " ("
+                           << err << ": " << strerror(err) << ")";
+    }
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+        return;
+
+    counters_set((name + " cpu").c_str(), cpu);
+    counters_set((name + " node").c_str(), node);
+    VLOG(LOG_INIT) << "reactor " << name << " on cpu " << cpu << " node "
+                   << node;
+}
+
+void reactor::thread_func(group *g, size_t id)
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    worker *w = g->workers[id].get();
+    handler_ptr h;
+    uint64_t val;
+    int num;
+
+    place(g, id);
+    t_reactor = this;
+    t_worker = w;
+
+    while (m_running) {
+        /* count as idle before looking for work, so a thread queueing more
+         * handlers either kicks this one or has them stolen right here
+         */
+        g->idle++;
+        h = take(g, id);
+        num = h ? 0 : epoll_wait(g->epoll, events, REACTOR_EVENTS, -1);
+        g->idle--;
+
+        if (h) {
+            dispatch(h);
+            continue;
+        }
+
+        if (num < 0) {
+            LOG_IF(ERROR, errno != EINTR) << "epoll_wait() failed ("
+                                          << errno << ": "
+                                          << strerror(errno) << ")";
+            continue;
+        }
+
+        for (int i = 0; i < num && m_running; ++i) {
+            int fd = events[i].data.fd;
+
+            if (fd == m_stop)
+                break;
+
+            if (fd == g->kick) {
+                if (read(g->kick, &val, sizeof(val)) < 0 && errno != EAGAIN)
+                    PLOG(ERROR) << "reactor: Failed to read kick event";
+                rearm(g, g->kick);
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_handlers_lock);
+                auto it = m_handlers.find(fd);
+
+                if (it == m_handlers.end())
+                    continue;
+
+                h = it->second;
+            }
+
+            /* epoll disarmed it; dispatch re-arms it even if an inline
+             * notify() queued it already
+             */
+            h->armed = false;
+            queue(w, h);
+        }
+
+        h.reset();
+
+        {
+            std::lock_guard<std::mutex> lock(w->lock);
+
+            if (w->ready.size() > 1)
+                kick(g);
+        }
+
+        while (m_running && (h = take(g, id)))
+            dispatch(h);
+    }
+
+    VLOG(LOG_INIT) << "reactor exit";
+}
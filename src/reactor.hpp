@@ -0,0 +1,180 @@
+#pragma once
+
+#include <sched.h>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+#include "counters.hpp"
+
+/* Event loop shared by io and the coders. File descriptors are watched
+ * with epoll from a fixed pool of threads, one per core by default, and each
+ * ready descriptor runs its callback on one thread at a time (EPOLLONESHOT,
+ * re-armed once the callback returns). Eventfds are used for queue
+ * notifications and timerfds for timeouts, so nothing wakes up unless there
+ * is work to do.
+ *
+ * A thread queues the descriptors returned by one epoll_wait() on its own
+ * ready list and works through it from the front. When more than one is
+ * left it kicks an idle thread, which steals from the back of the list, so
+ * a burst of ready coders spreads over the cores instead of running one
+ * after another on the thread that happened to wake up.
+ *
+ * Threads are organized in groups, each with its own epoll instance and
+ * optionally pinned to a set of CPUs. The coders run in one group per NUMA
+ * node of the coder CPUs, group 0 being the first, and as threads only
+ * steal within their group a coder stays on the node holding its symbol
+ * storage. io adds groups to keep its reader and writer off the coder cores.
+ */
+class reactor : public counters_api
+{
+  public:
+    typedef std::shared_ptr<reactor> pointer;
+    typedef std::function<void()> callback;
+    typedef std::chrono::steady_clock::duration duration;
+
+  private:
+    struct group;
+
+    struct handler
+    {
+        int fd;
+        bool owned;
+        bool removed = {false};
+        bool armed = {true};
+        std::atomic<bool> queued = {false};
+        group *grp;
+        callback cb;
+        std::mutex lock;
+    };
+    typedef std::shared_ptr<handler> handler_ptr;
+
+    struct worker
+    {
+        std::deque<handler_ptr> ready;
+        std::mutex lock;
+    };
+
+    struct group
+    {
+        std::string name;
+        std::vector<std::unique_ptr<worker>> workers;
+        std::vector<cpu_set_t> cpus;
+        std::atomic<size_t> idle = {0};
+        int node = {-1};
+        int epoll, kick;
+    };
+
+    std::unordered_map<int, handler_ptr> m_handlers;
+    std::vector<std::unique_ptr<group>> m_groups;
+    std::vector<std::thread> m_threads;
+    std::vector<size_t> m_coder_groups;
+    std::atomic<size_t> m_coder_next = {0};
+    std::mutex m_handlers_lock;
+    std::atomic<bool> m_running = {false};
+    std::atomic<size_t> m_steals = {0};
+    bool m_inline = {false};
+    int m_stop;
+
+    void add_coder_groups(size_t threads, const std::string &cpus);
+    int add(int fd, bool owned, callback cb, size_t grp);
+    void rearm(group *g, int fd);
+    void kick(group *g);
+    handler_ptr take(group *g, size_t id);
+    bool queue(worker *w, handler_ptr h);
+    void dispatch(handler_ptr h);
+    void place(group *g, size_t id);
+    void thread_func(group *g, size_t id);
+
+  public:
+    /* zero threads means one per core, or one per CPU in cpus */
+    reactor(size_t threads, const std::string &cpus = "");
+    ~reactor();
+    void start();
+    void stop();
+
+    /* add a group of threads pinned to the CPU list in cpus, each thread to
+     * one CPU of it in turn if there are several; must be called before
+     * start() and returns the group to pass when adding descriptors
+     */
+    size_t add_group(const std::string &name, size_t threads,
+                     const std::string &cpus);
+
+    /* watch fd for input; the caller keeps ownership of fd */
+    int add_fd(int fd, callback cb, size_t grp = 0);
+
+    /* create an eventfd that runs cb after each notify() */
+    int add_event(callback cb, size_t grp = 0);
+
+    /* create a timerfd that runs cb when an arm() expires */
+    int add_timer(callback cb, size_t grp = 0);
+
+    /* stop watching fd and wait for a running callback to return; must not
+     * be called from the callback of fd itself
+     */
+    void remove(int fd);
+
+    /* with inline notifications, notify() from a reactor thread queues the
+     * handler right behind the running callback on the same thread instead
+     * of waking epoll; meant for a single thread running everything to
+     * completion
+     */
+    void run_inline(bool enable)
+    {
+        m_inline = enable;
+    }
+
+    void notify(int fd);
+    void arm(int fd, duration timeout);
+    void disarm(int fd);
+
+    /* parse a CPU list like "0-3,8"; an empty list leaves set empty */
+    static void parse_cpus(const std::string &list, cpu_set_t *set);
+
+    /* NUMA node of cpu, or -1 if unknown */
+    static int cpu_node(int cpu);
+
+    /* group to add the event of a new coder to; the coder groups take
+     * turns
+     */
+    size_t coder_group()
+    {
+        return m_coder_groups[m_coder_next++ % m_coder_groups.size()];
+    }
+
+    /* NUMA node the threads of grp are pinned to, or -1 if not pinned to
+     * a single node
+     */
+    int node(size_t grp) const
+    {
+        return m_groups[grp]->node;
+    }
+
+    size_t coder_threads() const
+    {
+        size_t num = 0;
+
+        for (auto grp : m_coder_groups)
+            num += m_groups[grp]->workers.size();
+
+        return num;
+    }
+
+    size_t threads(size_t grp = 0) const
+    {
+        return m_groups[grp]->workers.size();
+    }
+
+    /* number of callbacks run by another thread than the one woken */
+    size_t steals() const
+    {
+        return m_steals;
+    }
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <glog/logging.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+/* Bounded lock-free queue on a power-of-two ring of cells. Each cell carries
+ * a sequence number telling whether it is free for the producer at a given
+ * position or holds a value for the consumer at that position, so producers
+ * and consumers only contend on their own index. Any number of threads may
+ * push and pop concurrently.
+ */
+template<typename Value>
+class ring_queue
+{
+    struct cell
+    {
+        std::atomic<size_t> seq;
+        Value val;
+    };
+
+    std::unique_ptr<cell[]> m_cells;
+    size_t m_mask;
+
+    /* keep producer and consumer indices on separate cache lines */
+    char m_pad0[64];
+    std::atomic<size_t> m_head = {0};
+    char m_pad1[64];
+    std::atomic<size_t> m_tail = {0};
+    char m_pad2[64];
+
+    static size_t round_up(size_t num)
+    {
+        size_t size = 2;
+
+        while (size < num)
+            size <<= 1;
+
+        return size;
+    }
+
+  public:
+    ring_queue(size_t num)
+        : m_cells(new cell[round_up(num)]),
+          m_mask(round_up(num) - 1)
+    {
+        for (size_t i = 0; i <= m_mask; ++i)
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    /* returns false if the ring is full */
+    bool push(Value val)
+    {
+        size_t pos = m_head.load(std::memory_order_relaxed), seq;
+        intptr_t diff;
+        cell *c;
+
+        while (true) {
+            c = &m_cells[pos & m_mask];
+            seq = c->seq.load(std::memory_order_acquire);
+            diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+            if (diff == 0 && m_head.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                break;
+            else if (diff < 0)
+                return false;
+            else if (diff != 0)
+                pos = m_head.load(std::memory_order_relaxed);
+        }
+
+        c->val = val;
+        c->seq.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    /* returns false if no value is ready */
+    bool pop(Value &val)
+    {
+        size_t pos = m_tail.load(std::memory_order_relaxed), seq;
+        intptr_t diff;
+        cell *c;
+
+        while (true) {
+            c = &m_cells[pos & m_mask];
+            seq = c->seq.load(std::memory_order_acquire);
+            diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+            if (diff == 0 && m_tail.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                break;
+            else if (diff < 0)
+                return false;
+            else if (diff != 0)
+                pos = m_tail.load(std::memory_order_relaxed);
+        }
+
+        val = c->val;
+        c->seq.store(pos + m_mask + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    /* may report a value that is claimed but not yet stored as present */
+    size_t size() const
+    {
+        size_t tail = m_tail.load(), head = m_head.load();
+
+        return head > tail ? head - tail : 0;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+};
+
+/* One ring_queue lane per priority. pop() always takes from the highest
+ * priority lane holding a value, like prio_queue does.
+ */
+template<typename Value>
+class prio_ring_queue
+{
+    std::vector<std::unique_ptr<ring_queue<Value> > > m_lanes;
+
+  public:
+    prio_ring_queue(size_t num, size_t lane_size)
+    {
+        for (size_t i = 0; i < num; ++i)
+            m_lanes.emplace_back(new ring_queue<Value>(lane_size));
+    }
+
+    bool push(size_t prio, Value val)
+    {
+        LOG_IF(FATAL, prio > m_lanes.size() - 1) << "priority too high: "
+                                                 << prio << " > "
+                                                 << (m_lanes.size() - 1);
+        return m_lanes[prio]->push(val);
+    }
+
+    bool pop(Value &val, size_t &prio)
+    {
+        for (prio = m_lanes.size(); prio-- > 0;)
+            if (m_lanes[prio]->pop(val))
+                return true;
+
+        return false;
+    }
+
+    bool pop(Value &val)
+    {
+        size_t prio;
+
+        return pop(val, prio);
+    }
+
+    /* pop from one lane only */
+    bool pop_lane(size_t prio, Value &val)
+    {
+        return m_lanes[prio]->pop(val);
+    }
+
+    size_t size() const
+    {
+        size_t size = 0;
+
+        for (auto &lane : m_lanes)
+            size += lane->size();
+
+        return size;
+    }
+
+    bool empty() const
+    {
+        for (auto &lane : m_lanes)
+            if (!lane->empty())
+                return false;
+
+        return true;
+    }
+};
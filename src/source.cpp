@@ -8,6 +8,9 @@
 #include <atomic>
 
 #include "io.hpp"
+#include "udp_tunnel.hpp"
+#include "packet_ring.hpp"
+#include "benchmark.hpp"
 #include "encoder_map.hpp"
 #include "decoder_map.hpp"
 #include "counters.hpp"
@@ -17,8 +20,34 @@ DEFINE_string(interface, "bat0", "Name of interface to register");
 DEFINE_int32(symbols, 64, "The generation size, the number of packets "
                                   "which are coded together.");
 DEFINE_int32(symbol_size, 1454, "The payload size without RLNC overhead.");
-DEFINE_bool(benchmark, false, "Bounce frames upon reception");
+DEFINE_bool(bounce, false, "Bounce plain frames back to the kernel upon "
+                           "reception.");
+DEFINE_bool(benchmark, false, "Measure throughput and latency of a local "
+                              "encoder and decoder pipeline, then exit.");
+DEFINE_int32(bench_size, 1000, "Size of benchmark frames.");
+DEFINE_int32(bench_count, 100000, "Number of benchmark frames.");
+DEFINE_int32(bench_rate, 0, "Offered benchmark frames per second; 0 sends as "
+                            "fast as the encoders take them.");
+DEFINE_int32(bench_erasure, -1, "Percentage of coded frames lost between "
+                                "the benchmark encoder and decoder (-1 for "
+                                "--e3).");
+DEFINE_double(bench_timeout, 5, "Seconds to wait for the last benchmark "
+                                "frames to be decoded.");
 DEFINE_int32(encoders, 2, "Number of concurrent encoder.");
+DEFINE_int32(encoder_shards, 1, "Number of encoder shards plain frames are "
+                                "spread over by flow, each with its own "
+                                "encoders (0 for one per coder thread).");
+DEFINE_bool(shard_tuple, false, "Hash the IP addresses, protocol and ports "
+                                "along with the source and destination "
+                                "when picking the shard of a frame.");
+DEFINE_int32(stage_depth, 64, "Plain frames held while all encoders are busy; "
+                              "staged frames keep their receive buffers, so "
+                              "keep it well below rx_pool.");
+DEFINE_int32(stage_high, 75, "Staging buffer fill in percent at which the "
+                             "kernel is blocked.");
+DEFINE_string(stage_drop, "tail", "Frame dropped when the staging buffer is "
+                                  "full: the arriving one (tail) or the "
+                                  "oldest one (head).");
 DEFINE_double(encoder_timeout, 10, "Time to wait for more packets before "
                                   "dropping encoder generation.");
 DEFINE_double(decoder_timeout, 10, "Time to wait for more packets before "
@@ -32,6 +61,62 @@ DEFINE_double(fixed_overshoot, 1.06, "Fixed factor to increase "
 DEFINE_int32(e1, 99, "Error probability from source to helper in percentage.");
 DEFINE_int32(e2, 99, "Error probability from helper to dest in percentage.");
 DEFINE_int32(e3, 30, "Error probability from source to dest in percentage.");
+DEFINE_int32(msg_pool, 512, "Number of outgoing netlink messages kept in "
+                            "the message pool.");
+DEFINE_int32(nl_buffer, 1048576, "Initial size of the netlink socket buffers "
+                                 "in bytes.");
+DEFINE_int32(nl_buffer_max, 16777216, "Size the netlink socket buffers may "
+                                      "grow to after kernel overruns.");
+DEFINE_int32(congestion_hold, 100, "Milliseconds without overruns before "
+                                   "encoders are unblocked again.");
+DEFINE_int32(io_sockets, 1, "Number of netlink sockets, each with its own "
+                           "reader; 2 splits off control frames and 3 also "
+                           "coded frames.");
+DEFINE_int32(reactor_threads, 0, "Number of threads running io and coder "
+                                "events (0 for one per core).");
+DEFINE_string(coder_cpus, "", "CPU list like 0-3,8 to spread the coder "
+                             "threads over, one CPU per thread.");
+DEFINE_string(reader_cpus, "", "CPU list to pin dedicated io reader threads "
+                              "to; readers share the coder threads if empty.");
+DEFINE_string(writer_cpus, "", "CPU list to pin a dedicated io writer thread "
+                              "to; the writer shares the coder threads if "
+                              "empty.");
+DEFINE_bool(single_thread, false, "Read, code and write each frame to "
+                                 "completion on a single thread.");
+DEFINE_int32(read_batch, 32, "Maximum number of datagrams received per "
+                             "syscall (0 or 1 to use libnl receive).");
+DEFINE_int32(rx_pool, 256, "Number of receive buffers recycled between the io "
+                           "reader and the coders.");
+DEFINE_int32(write_batch, 64, "Maximum number of frames sent to the kernel "
+                              "per syscall.");
+DEFINE_int32(write_queue, 1024, "Capacity of each priority lane in the io "
+                                "write queue.");
+DEFINE_string(write_sched, "prio", "Order of the io write queue: strict "
+                                  "priority (prio) or earliest deadline "
+                                  "first (deadline).");
+DEFINE_int32(write_deadline, 500, "Deadline step in microseconds; each lane "
+                                  "below the highest waits one step longer.");
+DEFINE_string(pace_rate, "", "Pace the writer per traffic class, as a list "
+                             "of class=kbit/s or class=auto, with classes "
+                             "data, ctrl and enc.");
+DEFINE_int32(pace_burst, 16384, "Bytes a paced class may send back to back.");
+DEFINE_bool(nl_batch, true, "Offer the kernel to exchange several frames "
+                            "per netlink message.");
+DEFINE_string(udp_bind, "0.0.0.0:4790", "Local address of the UDP tunnel.");
+DEFINE_string(udp_peer, "", "Tunnel coded frames to this host:port over UDP "
+                            "instead of using batman_adv.");
+DEFINE_string(tun, "", "TUN device carrying plain frames of the UDP tunnel; "
+                       "its MTU must leave two bytes of each symbol.");
+DEFINE_bool(udp_gso, true, "Use UDP segmentation and receive offload when "
+                           "the kernel supports it.");
+DEFINE_string(packet_if, "", "Exchange frames as raw ethernet frames on this "
+                             "interface through TPACKET_V3 rings.");
+DEFINE_int32(packet_blocks, 64, "Number of blocks in each packet ring.");
+DEFINE_int32(packet_block_size, 1048576, "Size of each packet ring block.");
+DEFINE_int32(packet_timeout, 1, "Milliseconds before a partly filled rx block "
+                                "is handed over.");
+DEFINE_int32(packet_pinned, 4096, "Maximum number of received frames held in "
+                                  "the rx ring at a time.");
 
 static std::atomic<bool> running(true);
 
@@ -55,6 +140,15 @@ int main(int argc, char **argv)
     signal(SIGTERM, sigint);
 
     counters_base::pointer c(new counters_base);
+
+    if (FLAGS_benchmark) {
+        benchmark b(c);
+        b.run(running);
+        b.report();
+        c->print();
+        return 0;
+    }
+
     ctrl_tracker::pointer ack_tracker(new ctrl_tracker(FLAGS_ack_timeout*1000));
     ctrl_tracker::pointer req_tracker(new ctrl_tracker(FLAGS_req_timeout*1000));
     io::pointer i(new io);
@@ -70,7 +164,22 @@ int main(int argc, char **argv)
     dec_map->ctrl_trackers(ctrl_tracker_api::ACK, ack_tracker);
     dec_map->ctrl_trackers(ctrl_tracker_api::REQ, req_tracker);
 
+    if (!FLAGS_udp_peer.empty()) {
+        std::shared_ptr<udp_tunnel> t(new udp_tunnel(FLAGS_udp_bind,
+                                                     FLAGS_udp_peer,
+                                                     FLAGS_tun));
+        t->counters(c);
+        i->set_backend(t);
+    } else if (!FLAGS_packet_if.empty()) {
+        packet_ring::pointer r(new packet_ring(FLAGS_packet_if,
+                                               FLAGS_packet_pinned));
+        r->counters(c);
+        i->set_backend(r);
+    }
+
     i->counters(c);
+    i->pool()->counters(c);
+    i->loop()->counters(c);
     i->set_encoder_map(enc_map);
     i->set_decoder_map(dec_map);
     i->netlink_open();
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include <cstdint>
+
+/* Symbol storage of a coder. The pages are mapped but not touched here, and
+ * bind() prefers the NUMA node of the reactor group the coder runs in, so
+ * they are allocated there on first touch and again after discard().
+ * Without a node the kernel places them wherever they are first written.
+ */
+class symbol_storage
+{
+    uint8_t *m_data = {NULL};
+    size_t m_size = {0};
+
+  public:
+    ~symbol_storage()
+    {
+        if (m_data)
+            munmap(m_data, m_size);
+    }
+
+    void alloc(size_t size)
+    {
+        void *data;
+
+        CHECK(m_data == NULL) << "symbol storage allocated twice";
+
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        PCHECK(data != MAP_FAILED) << "Failed to map symbol storage";
+
+        m_data = static_cast<uint8_t *>(data);
+        m_size = size;
+    }
+
+    /* prefer node for the pages, moving any already touched; libnuma is
+     * not linked, so this calls mbind() directly
+     */
+    void bind(int node)
+    {
+        unsigned long mask[16] = {0};
+        size_t word = sizeof(mask[0]) * 8, bits = sizeof(mask) * 8;
+
+        if (!m_data || node < 0 || size_t(node) >= bits)
+            return;
+
+        mask[node / word] |= 1UL << (node % word);
+
+        if (syscall(SYS_mbind, m_data, m_size, MPOL_PREFERRED, mask, bits + 1,
+                    MPOL_MF_MOVE) < 0)
+            PLOG(WARNING) << "Failed to bind symbol storage to node " << node;
+    }
+
+    /* give the pages back; they read as zeroes when touched again */
+    void discard()
+    {
+        if (m_data && madvise(m_data, m_size, MADV_DONTNEED) < 0)
+            PLOG(ERROR) << "Failed to discard symbol storage";
+    }
+
+    uint8_t *data() const
+    {
+        return m_data;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+};
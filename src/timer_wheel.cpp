@@ -0,0 +1,199 @@
+#include <glog/logging.h>
+#include <cstring>
+
+#include "logging.hpp"
+#include "timer_wheel.hpp"
+
+timer_wheel::timer_wheel(reactor::pointer loop)
+    : m_loop(loop),
+      m_start(clock::now())
+{
+    memset(m_slots, 0, sizeof(m_slots));
+    m_timer = m_loop->add_timer(std::bind(&timer_wheel::run, this));
+}
+
+timer_wheel::~timer_wheel()
+{
+    m_loop->remove(m_timer);
+}
+
+/* Whole ticks elapsed from the start of the wheel until t */
+uint64_t timer_wheel::ticks(clock::time_point t) const
+{
+    auto d = std::chrono::duration_cast<std::chrono::milliseconds>(t - m_start);
+
+    return d.count() > 0 ? d.count() : 0;
+}
+
+void timer_wheel::link(entry &e)
+{
+    uint64_t delta = e.m_expires - m_now;
+    size_t level = 0, slot;
+    entry **head;
+
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+        level++;
+
+    /* beyond the top level the deadline is cut short */
+    if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS)))
+        e.m_expires = m_now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    slot = (e.m_expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    head = &m_slots[level][slot];
+
+    e.m_next = *head;
+    e.m_pprev = head;
+
+    if (*head)
+        (*head)->m_pprev = &e.m_next;
+
+    *head = &e;
+}
+
+void timer_wheel::unlink(entry &e)
+{
+    *e.m_pprev = e.m_next;
+
+    if (e.m_next)
+        e.m_next->m_pprev = e.m_pprev;
+
+    e.m_next = NULL;
+    e.m_pprev = NULL;
+}
+
+/* Move entries of the higher levels down when a lower level wraps */
+void timer_wheel::cascade()
+{
+    entry *e, *next;
+    size_t slot;
+
+    for (size_t level = 1; level < WHEEL_LEVELS; ++level) {
+        slot = (m_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        e = m_slots[level][slot];
+        m_slots[level][slot] = NULL;
+
+        for (; e; e = next) {
+            next = e->m_next;
+            e->m_pprev = NULL;
+            link(*e);
+        }
+
+        if (slot)
+            break;
+    }
+}
+
+/* The earliest tick with something to do: an expiry or a cascade */
+uint64_t timer_wheel::next_tick() const
+{
+    uint64_t tick;
+
+    for (tick = m_now + 1; tick & WHEEL_MASK; ++tick)
+        if (m_slots[0][tick & WHEEL_MASK])
+            break;
+
+    return tick;
+}
+
+void timer_wheel::rearm()
+{
+    clock::time_point at;
+    uint64_t next;
+
+    if (!m_count) {
+        m_loop->disarm(m_timer);
+        m_armed = UINT64_MAX;
+        return;
+    }
+
+    next = next_tick();
+
+    if (next == m_armed)
+        return;
+
+    at = m_start + std::chrono::milliseconds(next);
+    m_loop->arm(m_timer, at - clock::now());
+    m_armed = next;
+}
+
+/* Runs on the reactor when the timerfd expires */
+void timer_wheel::run()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    uint64_t target = ticks(clock::now());
+    entry *e, *next;
+    size_t slot;
+
+    m_armed = UINT64_MAX;
+
+    while (m_count && m_now < target) {
+        m_now++;
+
+        if (!(m_now & WHEEL_MASK))
+            cascade();
+
+        slot = m_now & WHEEL_MASK;
+        e = m_slots[0][slot];
+        m_slots[0][slot] = NULL;
+
+        for (; e; e = next) {
+            next = e->m_next;
+            e->m_next = NULL;
+            e->m_pprev = NULL;
+            e->m_fired = true;
+            m_count--;
+
+            if (e->m_cb)
+                e->m_cb();
+        }
+    }
+
+    if (m_now < target)
+        m_now = target;
+
+    rearm();
+}
+
+void timer_wheel::add(entry &e, clock::duration timeout)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    clock::time_point now = clock::now();
+    uint64_t expires;
+
+    if (e.m_pprev)
+        unlink(e);
+    else
+        m_count++;
+
+    /* an empty wheel may skip ahead instead of walking idle ticks */
+    if (m_count == 1)
+        m_now = std::max(m_now, ticks(now));
+
+    /* round up, so timers never fire early */
+    expires = ticks(now + timeout + std::chrono::milliseconds(1) -
+                    clock::duration(1));
+    e.m_expires = std::max(expires, m_now + 1);
+    e.m_fired = false;
+    link(e);
+
+    if (next_tick() < m_armed)
+        rearm();
+}
+
+void timer_wheel::cancel(entry &e)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    e.m_fired = false;
+
+    if (!e.m_pprev)
+        return;
+
+    unlink(e);
+    m_count--;
+
+    /* leave the timerfd armed unless the wheel became empty */
+    if (!m_count)
+        rearm();
+}
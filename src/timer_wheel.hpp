@@ -0,0 +1,89 @@
+#pragma once
+
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+#include "reactor.hpp"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+/* Hierarchical timer wheel with millisecond ticks, driven by a single
+ * timerfd on the reactor. The coders register their REQ, ACK and generation
+ * deadlines here instead of each having a timerfd and comparing timestamps
+ * on every wakeup.
+ *
+ * Entries are embedded in their owner and linked into one slot of the
+ * wheel, so adding and cancelling are O(1). Level 0 holds the next 64 ticks
+ * and every further level 64 times as many, cascading down as time passes.
+ * The timerfd is only armed while entries are pending, at most 64 ticks
+ * ahead. An entry firing sets its expired flag and runs its callback with
+ * the wheel locked, which is meant to notify the owner so the work happens
+ * on the owner's own reactor handler; callbacks must not use the wheel.
+ */
+class timer_wheel
+{
+  public:
+    typedef std::shared_ptr<timer_wheel> pointer;
+    typedef std::chrono::steady_clock clock;
+    typedef std::function<void()> callback;
+
+    class entry
+    {
+        friend class timer_wheel;
+
+        entry *m_next = {NULL}, **m_pprev = {NULL};
+        uint64_t m_expires = {0};
+        std::atomic<bool> m_fired = {false};
+        callback m_cb;
+
+      public:
+        void set_callback(callback cb)
+        {
+            m_cb = cb;
+        }
+
+        /* true once for each time the entry fired */
+        bool expired()
+        {
+            return m_fired.exchange(false);
+        }
+    };
+
+  private:
+    reactor::pointer m_loop;
+    std::mutex m_lock;
+    entry *m_slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    clock::time_point m_start;
+    uint64_t m_now = {0}, m_armed = {UINT64_MAX};
+    size_t m_count = {0};
+    int m_timer;
+
+    uint64_t ticks(clock::time_point t) const;
+    uint64_t next_tick() const;
+    void link(entry &e);
+    void unlink(entry &e);
+    void cascade();
+    void run();
+    void rearm();
+
+  public:
+    timer_wheel(reactor::pointer loop);
+    ~timer_wheel();
+
+    /* (re)schedule e to fire after timeout */
+    void add(entry &e, clock::duration timeout);
+    void cancel(entry &e);
+
+    size_t pending()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_count;
+    }
+};
@@ -0,0 +1,515 @@
+#include <netlink/genl/genl.h>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <netinet/udp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+
+#include "logging.hpp"
+#include "frame.hpp"
+#include "msg_pool.hpp"
+#include "io.hpp"
+#include "udp_tunnel.hpp"
+
+/* not in older libc headers */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+DECLARE_bool(udp_gso);
+DECLARE_int32(read_batch);
+DECLARE_int32(symbol_size);
+
+/* receive slot without GRO; larger than any frame we send */
+#define UDP_RX_BUF_SIZE 2048
+
+/* limits for one GSO send */
+#define UDP_GSO_SEGS 64
+#define UDP_GSO_BYTES 65000
+
+/* attribute headers and addresses besides the payload of a rebuilt frame */
+#define UDP_ATTR_ROOM 128
+
+static const uint8_t udp_addr[ETH_ALEN] = {0};
+
+udp_tunnel::udp_tunnel(const std::string &bind_addr,
+                       const std::string &peer_addr,
+                       const std::string &tun_name)
+    : m_bind_addr(bind_addr),
+      m_peer_addr(peer_addr),
+      m_tun_name(tun_name)
+{
+    counters_group("udp");
+}
+
+udp_tunnel::~udp_tunnel()
+{
+    if (m_loop && m_sock >= 0)
+        m_loop->remove(m_sock);
+
+    if (m_loop && m_tun >= 0)
+        m_loop->remove(m_tun);
+
+    if (m_sock >= 0)
+        close(m_sock);
+
+    if (m_tun >= 0)
+        close(m_tun);
+}
+
+/* Parse host:port, with [host]:port for IPv6 */
+void udp_tunnel::resolve(const std::string &addr, struct sockaddr_storage *ss,
+                         socklen_t *len)
+{
+    struct addrinfo hints, *res;
+    size_t colon = addr.rfind(':');
+    std::string host, port;
+    int ret;
+
+    CHECK_NE(colon, std::string::npos) << "udp: Missing port in " << addr;
+    host = addr.substr(0, colon);
+    port = addr.substr(colon + 1);
+
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    ret = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                      &hints, &res);
+    CHECK_EQ(ret, 0) << "udp: Failed to resolve " << addr << ": "
+                     << gai_strerror(ret);
+
+    memcpy(ss, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+void udp_tunnel::open_socket()
+{
+    struct sockaddr_storage local;
+    socklen_t local_len;
+    int val;
+
+    resolve(m_peer_addr, &m_peer, &m_peer_len);
+    resolve(m_bind_addr, &local, &local_len);
+
+    m_sock = socket(local.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    IPPROTO_UDP);
+    PCHECK(m_sock >= 0) << "udp: Failed to create socket";
+
+    PCHECK(bind(m_sock, reinterpret_cast<struct sockaddr *>(&local),
+                local_len) == 0) << "udp: Failed to bind " << m_bind_addr;
+
+    /* probe for segmentation offload; a zero size leaves it per send */
+    val = 0;
+    m_gso = FLAGS_udp_gso &&
+            setsockopt(m_sock, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)) == 0;
+
+    val = 1;
+    m_gro = FLAGS_udp_gso &&
+            setsockopt(m_sock, SOL_UDP, UDP_GRO, &val, sizeof(val)) == 0;
+
+    LOG(INFO) << "udp: bound to " << m_bind_addr << ", peer " << m_peer_addr
+              << " (gso: " << m_gso << ", gro: " << m_gro << ")";
+}
+
+void udp_tunnel::open_tun()
+{
+    struct ifreq ifr;
+
+    m_tun = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    PCHECK(m_tun >= 0) << "udp: Failed to open /dev/net/tun";
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, m_tun_name.c_str(), IFNAMSIZ - 1);
+
+    PCHECK(ioctl(m_tun, TUNSETIFF, &ifr) == 0)
+        << "udp: Failed to attach to tun device " << m_tun_name;
+
+    m_tun_name = ifr.ifr_name;
+    m_tun_buf.resize(FLAGS_symbol_size);
+}
+
+void udp_tunnel::open()
+{
+    size_t slots = std::max(FLAGS_read_batch, 1), slot_size;
+    size_t ctrl_size = CMSG_SPACE(sizeof(int));
+
+    m_loop = m_io->loop();
+    open_socket();
+
+    if (!m_tun_name.empty())
+        open_tun();
+
+    slot_size = m_gro ? 65536 : UDP_RX_BUF_SIZE;
+    m_rx_slot = slot_size;
+    m_rx_buf.resize(slots * slot_size);
+    m_rx_ctrl.resize(slots * ctrl_size);
+    m_rx_hdrs.resize(slots);
+    m_rx_iovs.resize(slots);
+
+    for (size_t i = 0; i < slots; ++i) {
+        m_rx_iovs[i].iov_base = &m_rx_buf[i * slot_size];
+        m_rx_iovs[i].iov_len = slot_size;
+    }
+
+    m_loop->add_fd(m_sock, std::bind(&udp_tunnel::udp_ready, this),
+                   m_io->read_group());
+
+    if (m_tun >= 0)
+        m_loop->add_fd(m_tun, std::bind(&udp_tunnel::tun_ready, this),
+                       m_io->read_group());
+}
+
+/* Answer our own registration like the kernel would */
+void udp_tunnel::register_node()
+{
+    struct nl_msg *msg = m_io->rx_buffer(NLMSG_HDRLEN + GENL_HDRLEN + 64);
+    uint32_t ifindex = m_tun >= 0 ? if_nametoindex(m_tun_name.c_str()) : 0;
+
+    msg_pool::reset(msg);
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_REGISTER, 1));
+    CHECK_EQ(nla_put_u32(msg, BATADV_HLP_A_IFINDEX, ifindex), 0);
+
+    std::lock_guard<std::mutex> lock(m_rx_lock);
+    m_io->deliver(msg);
+}
+
+void udp_tunnel::start()
+{}
+
+void udp_tunnel::stop()
+{}
+
+/* Rebuild a frame message from a datagram; m_rx_lock is held */
+void udp_tunnel::deliver_udp(const uint8_t *buf, size_t len)
+{
+    const struct frame_hdr *hdr;
+    struct nl_msg *msg;
+    size_t plen;
+
+    if (len < sizeof(*hdr)) {
+        counters_increment("rx short");
+        return;
+    }
+
+    hdr = reinterpret_cast<const struct frame_hdr *>(buf);
+    plen = len - sizeof(*hdr);
+
+    /* plain frames only come from the tun device, never from the peer */
+    if (hdr->type == PLAIN_PACKET || !m_io->frame_valid(hdr->type, plen)) {
+        counters_increment("rx invalid");
+        return;
+    }
+
+    msg = m_io->rx_buffer(NLMSG_HDRLEN + GENL_HDRLEN + plen + UDP_ATTR_ROOM);
+    msg_pool::reset(msg);
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_FRAME, 1));
+    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, hdr->type), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, udp_addr), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, udp_addr), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_BLOCK, ntohs(hdr->uid)), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_RANK, ntohs(hdr->rank)), 0);
+    CHECK_EQ(nla_put_u16(msg, BATADV_HLP_A_SEQ, ntohs(hdr->seq)), 0);
+
+    if (plen)
+        CHECK_EQ(nla_put(msg, BATADV_HLP_A_FRAME, plen, hdr + 1), 0);
+
+    m_io->deliver(msg);
+}
+
+/* Turn a packet from the tun device into a plain frame; m_rx_lock is held */
+void udp_tunnel::deliver_plain(const uint8_t *buf, size_t len)
+{
+    struct nl_msg *msg;
+
+    msg = m_io->rx_buffer(NLMSG_HDRLEN + GENL_HDRLEN + len + UDP_ATTR_ROOM);
+    msg_pool::reset(msg);
+    CHECK_NOTNULL(genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, m_io->family(),
+                              0, 0, BATADV_HLP_C_FRAME, 1));
+    CHECK_EQ(nla_put_u8(msg, BATADV_HLP_A_TYPE, PLAIN_PACKET), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, udp_addr), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, udp_addr), 0);
+    CHECK_EQ(nla_put(msg, BATADV_HLP_A_FRAME, len, buf), 0);
+
+    m_io->deliver(msg);
+}
+
+void udp_tunnel::udp_ready()
+{
+    struct cmsghdr *cm;
+    size_t len, seg, ctrl_size = CMSG_SPACE(sizeof(int));
+    uint8_t *buf;
+    int num;
+
+    for (size_t i = 0; i < m_rx_hdrs.size(); ++i) {
+        memset(&m_rx_hdrs[i], 0, sizeof(m_rx_hdrs[i]));
+        m_rx_hdrs[i].msg_hdr.msg_iov = &m_rx_iovs[i];
+        m_rx_hdrs[i].msg_hdr.msg_iovlen = 1;
+        m_rx_hdrs[i].msg_hdr.msg_control = &m_rx_ctrl[i * ctrl_size];
+        m_rx_hdrs[i].msg_hdr.msg_controllen = ctrl_size;
+    }
+
+    num = recvmmsg(m_sock, &m_rx_hdrs[0], m_rx_hdrs.size(), 0, NULL);
+
+    if (num < 0) {
+        LOG_IF(ERROR, errno != EINTR && errno != EAGAIN)
+            << "udp: recvmmsg() failed (" << errno << ": " << strerror(errno)
+            << ")";
+        return;
+    }
+
+    counters_increment("rx recv");
+    std::lock_guard<std::mutex> lock(m_rx_lock);
+
+    for (int i = 0; i < num; ++i) {
+        buf = static_cast<uint8_t *>(m_rx_iovs[i].iov_base);
+        len = m_rx_hdrs[i].msg_len;
+        seg = len;
+
+        /* with GRO one buffer holds several datagrams of the same size */
+        for (cm = CMSG_FIRSTHDR(&m_rx_hdrs[i].msg_hdr); cm;
+             cm = CMSG_NXTHDR(&m_rx_hdrs[i].msg_hdr, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                seg = *reinterpret_cast<int *>(CMSG_DATA(cm));
+        }
+
+        if (seg < len)
+            counters_increment("rx gro");
+
+        for (size_t off = 0; off < len && seg; off += seg) {
+            deliver_udp(buf + off, std::min(seg, len - off));
+            counters_increment("rx");
+        }
+    }
+}
+
+void udp_tunnel::tun_ready()
+{
+    ssize_t len;
+
+    std::lock_guard<std::mutex> lock(m_rx_lock);
+
+    /* a tun device has no batched read, so bound the reads per wakeup */
+    for (int i = 0; i < std::max(FLAGS_read_batch, 1); ++i) {
+        len = read(m_tun, &m_tun_buf[0], m_tun_buf.size());
+
+        if (len < 0) {
+            LOG_IF(ERROR, errno != EINTR && errno != EAGAIN)
+                << "udp: tun read failed (" << errno << ": "
+                << strerror(errno) << ")";
+            return;
+        }
+
+        /* the encoder keeps two bytes of each symbol for the length */
+        if (static_cast<size_t>(len) + sizeof(uint16_t) > m_tun_buf.size()) {
+            counters_increment("tun oversize");
+            continue;
+        }
+
+        /* like the kernel, drop plain frames while the encoders are full */
+        if (m_blocked) {
+            counters_increment("tun drop");
+            continue;
+        }
+
+        counters_increment("tun rx");
+        deliver_plain(&m_tun_buf[0], len);
+    }
+}
+
+/* Write the wire format of a frame message to buf and return its length,
+ * or zero if the frame does not go to the peer
+ */
+size_t udp_tunnel::serialize(struct nl_msg *msg, uint8_t *buf)
+{
+    struct nlattr *attrs[BATADV_HLP_A_NUM];
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    struct frame_hdr *hdr = reinterpret_cast<struct frame_hdr *>(buf);
+
+    genlmsg_parse(nlh, 0, attrs, BATADV_HLP_A_MAX, NULL);
+    struct frame f(msg, attrs);
+
+    switch (f.type) {
+        case DEC_PACKET:
+            if (m_tun >= 0 && write(m_tun, f.data, f.len) < 0)
+                PLOG(ERROR) << "udp: tun write failed";
+            counters_increment("tun tx");
+            return 0;
+
+        case ENC_PACKET:
+        case REQ_PACKET:
+        case ACK_PACKET:
+            break;
+
+        default:
+            counters_increment("unrouted");
+            return 0;
+    }
+
+    hdr->type = f.type;
+    hdr->reserved = 0;
+    hdr->uid = htons(f.uid);
+    hdr->rank = htons(f.rank);
+    hdr->seq = htons(f.seq);
+
+    if (f.len)
+        memcpy(hdr + 1, f.data, f.len);
+
+    return sizeof(*hdr) + f.len;
+}
+
+void udp_tunnel::send(struct nl_msg **msgs, size_t num)
+{
+    struct genlmsghdr *gnlh;
+    size_t off = 0, len, room;
+
+    m_tx_frames.clear();
+
+    for (size_t i = 0; i < num; ++i) {
+        gnlh = static_cast<struct genlmsghdr *>(nlmsg_data(nlmsg_hdr(msgs[i])));
+
+        switch (gnlh->cmd) {
+            case BATADV_HLP_C_BLOCK:
+                counters_increment("block");
+                m_blocked = true;
+                continue;
+
+            case BATADV_HLP_C_UNBLOCK:
+                m_blocked = false;
+                continue;
+
+            case BATADV_HLP_C_FRAME:
+                break;
+
+            default:
+                continue;
+        }
+
+        /* the payload can never exceed the message it came in */
+        room = sizeof(struct frame_hdr) + nlmsg_hdr(msgs[i])->nlmsg_len;
+        if (m_tx_buf.size() < off + room)
+            m_tx_buf.resize(off + room);
+
+        len = serialize(msgs[i], &m_tx_buf[off]);
+        if (!len)
+            continue;
+
+        m_tx_frames.push_back(std::make_pair(off, len));
+        off += len;
+    }
+
+    send_frames();
+}
+
+/* Send the serialized frames, merging runs of equal length into one GSO
+ * buffer each
+ */
+void udp_tunnel::send_frames()
+{
+    size_t ctrl_size = CMSG_SPACE(sizeof(uint16_t));
+    size_t num = 0, sent = 0, frames = 0, off, seg, count;
+    struct cmsghdr *cm;
+    int res;
+
+    m_tx_hdrs.resize(m_tx_frames.size());
+    m_tx_iovs.resize(m_tx_frames.size());
+    m_tx_ctrl.resize(m_tx_frames.size() * ctrl_size);
+    m_tx_counts.resize(m_tx_frames.size());
+
+    for (size_t i = 0; i < m_tx_frames.size(); i += count) {
+        off = m_tx_frames[i].first;
+        seg = m_tx_frames[i].second;
+        count = 1;
+
+        while (m_gso && i + count < m_tx_frames.size() &&
+               count < UDP_GSO_SEGS &&
+               m_tx_frames[i + count].second == seg &&
+               (count + 1) * seg <= UDP_GSO_BYTES)
+            count++;
+
+        m_tx_iovs[num].iov_base = &m_tx_buf[off];
+        m_tx_iovs[num].iov_len = seg * count;
+
+        memset(&m_tx_hdrs[num], 0, sizeof(m_tx_hdrs[num]));
+        m_tx_hdrs[num].msg_hdr.msg_name = &m_peer;
+        m_tx_hdrs[num].msg_hdr.msg_namelen = m_peer_len;
+        m_tx_hdrs[num].msg_hdr.msg_iov = &m_tx_iovs[num];
+        m_tx_hdrs[num].msg_hdr.msg_iovlen = 1;
+
+        if (count > 1) {
+            m_tx_hdrs[num].msg_hdr.msg_control = &m_tx_ctrl[num * ctrl_size];
+            m_tx_hdrs[num].msg_hdr.msg_controllen = ctrl_size;
+            cm = CMSG_FIRSTHDR(&m_tx_hdrs[num].msg_hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *reinterpret_cast<uint16_t *>(CMSG_DATA(cm)) = seg;
+            counters_add("tx gso", count);
+        }
+
+        m_tx_counts[num] = count;
+        num++;
+    }
+
+    while (sent < num) {
+        res = sendmmsg(m_sock, &m_tx_hdrs[sent], num - sent, 0);
+
+        if (res < 0 && errno == EINTR)
+            continue;
+
+        /* the socket is non-blocking, so a full send buffer is congestion
+         * and the rest of the batch is dropped like an overrun netlink
+         * socket's
+         */
+        if (res < 0 && (errno == EAGAIN || errno == ENOBUFS)) {
+            counters_increment("tx overrun");
+            m_io->set_congested();
+
+            for (; sent < num; ++sent)
+                counters_add("tx overrun drop", m_tx_counts[sent]);
+
+            break;
+        }
+
+        /* skip the datagram that failed and keep sending the others */
+        if (res < 0) {
+            LOG(ERROR) << "udp: sendmmsg() failed (" << errno << ": "
+                       << strerror(errno) << ")";
+            counters_add("tx error", m_tx_counts[sent]);
+            sent++;
+            continue;
+        }
+
+        for (int i = 0; i < res; ++i)
+            frames += m_tx_counts[sent + i];
+
+        sent += res;
+        counters_increment("tx send");
+    }
+
+    counters_add("tx", frames);
+}
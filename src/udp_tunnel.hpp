@@ -0,0 +1,68 @@
+#pragma once
+
+#include <netlink/netlink.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "io_backend.hpp"
+#include "frame.hpp"
+#include "reactor.hpp"
+#include "counters.hpp"
+
+/* Backend tunnelling traffic over plain UDP instead of batman_adv. Plain
+ * frames are read from a TUN device and decoded frames written back to it,
+ * while ENC, REQ and ACK frames are exchanged with one peer over UDP. Runs
+ * of equally sized frames are sent as one UDP_SEGMENT (GSO) buffer, and
+ * UDP_GRO is used to receive coalesced datagrams, when the kernel has them.
+ */
+class udp_tunnel : public io_backend, public counters_api
+{
+    std::string m_bind_addr, m_peer_addr, m_tun_name;
+    struct sockaddr_storage m_peer;
+    socklen_t m_peer_len = {0};
+    reactor::pointer m_loop;
+    int m_sock = {-1}, m_tun = {-1};
+    bool m_gso = {false}, m_gro = {false};
+    std::atomic<bool> m_blocked = {false};
+    std::mutex m_rx_lock;
+
+    /* batched receive */
+    std::vector<uint8_t> m_rx_buf, m_rx_ctrl, m_tun_buf;
+    std::vector<struct mmsghdr> m_rx_hdrs;
+    std::vector<struct iovec> m_rx_iovs;
+    size_t m_rx_slot = {0};
+
+    /* batched transmit */
+    std::vector<uint8_t> m_tx_buf;
+    std::vector<std::pair<size_t, size_t> > m_tx_frames;
+    std::vector<struct mmsghdr> m_tx_hdrs;
+    std::vector<struct iovec> m_tx_iovs;
+    std::vector<uint8_t> m_tx_ctrl;
+    std::vector<size_t> m_tx_counts;
+
+    static void resolve(const std::string &addr, struct sockaddr_storage *ss,
+                        socklen_t *len);
+    void open_socket();
+    void open_tun();
+    void deliver_udp(const uint8_t *buf, size_t len);
+    void deliver_plain(const uint8_t *buf, size_t len);
+    void udp_ready();
+    void tun_ready();
+    size_t serialize(struct nl_msg *msg, uint8_t *buf);
+    void send_frames();
+
+  public:
+    udp_tunnel(const std::string &bind_addr, const std::string &peer_addr,
+               const std::string &tun_name);
+    ~udp_tunnel();
+
+    void open();
+    void register_node();
+    void start();
+    void stop();
+    void send(struct nl_msg **msgs, size_t num);
+};
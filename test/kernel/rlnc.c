@@ -12,6 +12,7 @@ enum {
 	BATADV_HLP_C_FRAME,
 	BATADV_HLP_C_BLOCK,
 	BATADV_HLP_C_UNBLOCK,
+	BATADV_HLP_C_FRAMES,
 	BATADV_HLP_C_NUM,
 };
 #define BATADV_HLP_C_MAX (BATADV_HLP_C_NUM - 1)
@@ -36,12 +37,31 @@ enum {
 	BATADV_HLP_A_E1,
 	BATADV_HLP_A_E2,
 	BATADV_HLP_A_E3,
+	BATADV_HLP_A_TYPES,
+	BATADV_HLP_A_FRAMES,
+	BATADV_HLP_A_FEATURES,
 	BATADV_HLP_A_NUM,
 };
 #define BATADV_HLP_A_MAX (BATADV_HLP_A_NUM - 1)
 
+enum {
+	BATADV_HLP_F_FRAMES = 1 << 0,
+};
+
+/* features this stub agrees to when a port offers them */
+#define RLNC_FEATURES BATADV_HLP_F_FRAMES
+
+#define RLNC_PORTS 3
+
+struct rlnc_port {
+	u32 port;
+	u32 types;
+	u32 features;
+};
+
 static int stub_port = 0;
-static int rlnc_port = 0;
+static struct rlnc_port rlnc_ports[RLNC_PORTS];
+static int rlnc_num = 0;
 
 struct genl_family rlnc_genl_family = {
 	.id = GENL_ID_GENERATE,
@@ -50,31 +70,79 @@ struct genl_family rlnc_genl_family = {
 	.maxattr = BATADV_HLP_A_MAX,
 };
 
-int rlnc_genl_recv(struct sk_buff *skb, struct genl_info *info)
+static struct rlnc_port *rlnc_find_port(u32 portid)
 {
-    struct sk_buff *skb_out = NULL;
-    void *msg_head;
-    u32 port, i;
+    int i;
 
-    if (stub_port && !rlnc_port && info->snd_portid != stub_port) {
-        rlnc_port = info->snd_portid;
-        printk("registered rlnc port: %i\n", rlnc_port);
-    } else if (!stub_port) {
-        stub_port = info->snd_portid;
-        printk("registered stub port: %i\n", stub_port);
-    }
+    for (i = 0; i < rlnc_num; i++)
+        if (rlnc_ports[i].port == portid)
+            return &rlnc_ports[i];
 
-    if (!stub_port) {
-        printk("waiting for stub port\n");
-        return 0;
-    }
+    return NULL;
+}
 
-    if(!rlnc_port) {
-        printk("waiting for rlnc port\n");
-        return 0;
+static void rlnc_register(struct genl_info *info)
+{
+    struct rlnc_port *p = rlnc_find_port(info->snd_portid);
+
+    if (!p && rlnc_num < RLNC_PORTS) {
+        p = &rlnc_ports[rlnc_num++];
+        p->port = info->snd_portid;
+        printk("registered rlnc port: %i\n", p->port);
     }
 
-    port = info->snd_portid == stub_port ? rlnc_port : stub_port;
+    if (!p)
+        return;
+
+    /* a socket without a type mask takes every type */
+    if (info->attrs[BATADV_HLP_A_TYPES])
+        p->types = nla_get_u32(info->attrs[BATADV_HLP_A_TYPES]);
+    else
+        p->types = ~0U;
+
+    /* old rlncd offers nothing and keeps getting single frames */
+    if (info->attrs[BATADV_HLP_A_FEATURES])
+        p->features = nla_get_u32(info->attrs[BATADV_HLP_A_FEATURES]) &
+                      RLNC_FEATURES;
+    else
+        p->features = 0;
+}
+
+/* pick the rlnc socket that asked for the frame type */
+static struct rlnc_port *rlnc_route_type(struct nlattr *attr)
+{
+    u32 type;
+    int i;
+
+    if (!attr)
+        return &rlnc_ports[0];
+
+    type = nla_get_u8(attr);
+
+    for (i = 0; i < rlnc_num; i++)
+        if (rlnc_ports[i].types & (1 << type))
+            return &rlnc_ports[i];
+
+    return &rlnc_ports[0];
+}
+
+static u32 rlnc_route(struct genl_info *info)
+{
+    return rlnc_route_type(info->attrs[BATADV_HLP_A_TYPE])->port;
+}
+
+/* pick the rlnc socket for one frame of a FRAMES message */
+static struct rlnc_port *rlnc_route_entry(struct nlattr *entry)
+{
+    return rlnc_route_type(nla_find(nla_data(entry), nla_len(entry),
+                                    BATADV_HLP_A_TYPE));
+}
+
+static int rlnc_forward(struct genl_info *info, u32 port, u32 features)
+{
+    struct sk_buff *skb_out = NULL;
+    void *msg_head;
+    u32 i;
 
     skb_out = genlmsg_new(GENLMSG_DEFAULT_SIZE, GFP_KERNEL);
     if (!skb_out)
@@ -83,7 +151,7 @@ int rlnc_genl_recv(struct sk_buff *skb, struct genl_info *info)
     msg_head = genlmsg_put(skb_out, 0, 0, &rlnc_genl_family, 0, info->genlhdr->cmd);
 
     for (i = 0; i < BATADV_HLP_A_NUM; i++) {
-        if (!info->attrs[i])
+        if (!info->attrs[i] || i == BATADV_HLP_A_FEATURES)
             continue;
 
         printk("add attr: %i\n", i);
@@ -92,6 +160,10 @@ int rlnc_genl_recv(struct sk_buff *skb, struct genl_info *info)
             printk("failed to put attr: %i\n", i);
     }
 
+    /* register replies tell the port what it may use */
+    if (features && nla_put_u32(skb_out, BATADV_HLP_A_FEATURES, features))
+        printk("failed to put features\n");
+
     genlmsg_end(skb_out, msg_head);
     genlmsg_unicast(genl_info_net(info), skb_out, port);
 
@@ -100,17 +172,158 @@ int rlnc_genl_recv(struct sk_buff *skb, struct genl_info *info)
     return 0;
 }
 
+/* send one frame of a FRAMES message as a FRAME message of its own */
+static void rlnc_forward_entry(struct genl_info *info, struct nlattr *entry,
+                               u32 port)
+{
+    struct sk_buff *skb_out;
+    void *msg_head;
+
+    skb_out = genlmsg_new(nla_len(entry), GFP_KERNEL);
+    if (!skb_out)
+        return;
+
+    msg_head = genlmsg_put(skb_out, 0, 0, &rlnc_genl_family, 0,
+                           BATADV_HLP_C_FRAME);
+    memcpy(skb_put(skb_out, nla_len(entry)), nla_data(entry), nla_len(entry));
+    genlmsg_end(skb_out, msg_head);
+    genlmsg_unicast(genl_info_net(info), skb_out, port);
+}
+
+/* the stub port only speaks single frames */
+static int rlnc_split(struct genl_info *info, u32 port)
+{
+    struct nlattr *entry;
+    int rem;
+
+    if (!info->attrs[BATADV_HLP_A_FRAMES])
+        return 0;
+
+    nla_for_each_nested(entry, info->attrs[BATADV_HLP_A_FRAMES], rem)
+        rlnc_forward_entry(info, entry, port);
+
+    return 0;
+}
+
+static void rlnc_frames_end(struct genl_info *info, struct sk_buff *skb_out,
+                            void *msg_head, struct nlattr *list, u32 port)
+{
+    nla_nest_end(skb_out, list);
+    genlmsg_end(skb_out, msg_head);
+    genlmsg_unicast(genl_info_net(info), skb_out, port);
+}
+
+/* regroup the frames from the stub port by the rlnc port they are routed to,
+ * keeping each message within GENLMSG_DEFAULT_SIZE
+ */
+static int rlnc_forward_frames(struct genl_info *info)
+{
+    struct sk_buff *skb_out;
+    struct nlattr *entry, *list = NULL;
+    struct rlnc_port *p;
+    void *msg_head = NULL;
+    int i, rem, idx;
+
+    if (!info->attrs[BATADV_HLP_A_FRAMES])
+        return 0;
+
+    for (i = 0; i < rlnc_num; i++) {
+        skb_out = NULL;
+        idx = 0;
+
+        nla_for_each_nested(entry, info->attrs[BATADV_HLP_A_FRAMES], rem) {
+            p = rlnc_route_entry(entry);
+            if (p != &rlnc_ports[i])
+                continue;
+
+            if (!(p->features & BATADV_HLP_F_FRAMES)) {
+                rlnc_forward_entry(info, entry, p->port);
+                continue;
+            }
+
+            if (skb_out &&
+                skb_tailroom(skb_out) < nla_total_size(nla_len(entry))) {
+                rlnc_frames_end(info, skb_out, msg_head, list, p->port);
+                skb_out = NULL;
+            }
+
+            if (!skb_out) {
+                skb_out = genlmsg_new(GENLMSG_DEFAULT_SIZE, GFP_KERNEL);
+                if (!skb_out)
+                    return 0;
+
+                msg_head = genlmsg_put(skb_out, 0, 0, &rlnc_genl_family, 0,
+                                       BATADV_HLP_C_FRAMES);
+                list = nla_nest_start(skb_out, BATADV_HLP_A_FRAMES);
+                idx = 0;
+            }
+
+            if (nla_put(skb_out, ++idx, nla_len(entry), nla_data(entry)))
+                printk("failed to put frame: %i\n", idx);
+        }
+
+        if (skb_out)
+            rlnc_frames_end(info, skb_out, msg_head, list, rlnc_ports[i].port);
+    }
+
+    return 0;
+}
+
+int rlnc_genl_recv(struct sk_buff *skb, struct genl_info *info)
+{
+    int i;
+
+    if (!stub_port) {
+        stub_port = info->snd_portid;
+        printk("registered stub port: %i\n", stub_port);
+    } else if (info->snd_portid != stub_port &&
+               info->genlhdr->cmd == BATADV_HLP_C_REGISTER) {
+        rlnc_register(info);
+    }
+
+    if (!stub_port) {
+        printk("waiting for stub port\n");
+        return 0;
+    }
+
+    if (!rlnc_num) {
+        printk("waiting for rlnc port\n");
+        return 0;
+    }
+
+    if (info->snd_portid != stub_port &&
+        info->genlhdr->cmd == BATADV_HLP_C_FRAMES)
+        return rlnc_split(info, stub_port);
+
+    if (info->snd_portid != stub_port)
+        return rlnc_forward(info, stub_port, 0);
+
+    /* register replies carry the ifindex every rlnc socket needs */
+    if (info->genlhdr->cmd == BATADV_HLP_C_REGISTER) {
+        for (i = 0; i < rlnc_num; i++)
+            rlnc_forward(info, rlnc_ports[i].port, rlnc_ports[i].features);
+
+        return 0;
+    }
+
+    if (info->genlhdr->cmd == BATADV_HLP_C_FRAMES)
+        return rlnc_forward_frames(info);
+
+    return rlnc_forward(info, rlnc_route(info), 0);
+}
+
 static int rlnc_netlink_notify(struct notifier_block *nb,
 			       unsigned long state, void *_notify)
 {
     if (state != NETLINK_URELEASE)
         return NOTIFY_DONE;
 
-    if (!stub_port && !rlnc_port)
+    if (!stub_port && !rlnc_num)
         return NOTIFY_DONE;
 
     stub_port = 0;
-    rlnc_port = 0;
+    rlnc_num = 0;
+    memset(rlnc_ports, 0, sizeof(rlnc_ports));
 
     printk("netlink unregistered");
 
@@ -147,6 +360,10 @@ static struct genl_ops rlnc_genl_ops[] = {
 		.cmd = BATADV_HLP_C_UNBLOCK,
 		.doit = rlnc_genl_recv,
 	},
+	[BATADV_HLP_C_FRAMES - 1] = {
+		.cmd = BATADV_HLP_C_FRAMES,
+		.doit = rlnc_genl_recv,
+	},
 };
 
 static struct notifier_block rlnc_netlink_notifier = {
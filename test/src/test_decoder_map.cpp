@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <netlink/genl/genl.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "io.hpp"
+#include "loopback.hpp"
+#include "decoder_map.hpp"
+
+DECLARE_bool(bounce);
+DECLARE_double(ack_timeout);
+DECLARE_double(req_timeout);
+
+class decoder_map_test : public ::testing::Test {
+    google::FlagSaver m_flags;
+
+  protected:
+    io::pointer m_io;
+    loopback::pointer m_link;
+    decoder_map::pointer m_map;
+    counters_base::pointer m_counts;
+    ctrl_tracker::pointer m_ack_tracker, m_req_tracker;
+
+    /* decoders give up on their generation after 50 ms without frames */
+    void open()
+    {
+        FLAGS_bounce = false;
+        FLAGS_decoder_timeout = .05;
+
+        m_counts.reset(new counters_base);
+        m_io = io::pointer(new io);
+        m_link = loopback::pointer(new loopback(0, 1024));
+        m_io->set_backend(m_link);
+
+        m_ack_tracker.reset(new ctrl_tracker(FLAGS_ack_timeout*1000));
+        m_req_tracker.reset(new ctrl_tracker(FLAGS_req_timeout*1000));
+
+        m_map = decoder_map::pointer(new decoder_map);
+        m_map->set_io(m_io);
+        m_map->counters(m_counts);
+        m_map->ctrl_trackers(ctrl_tracker_api::ACK, m_ack_tracker);
+        m_map->ctrl_trackers(ctrl_tracker_api::REQ, m_req_tracker);
+        m_io->set_decoder_map(m_map);
+
+        m_io->netlink_open();
+        m_io->netlink_register();
+        m_io->start();
+    }
+
+    void close()
+    {
+        m_io->stop();
+        m_map.reset();
+        m_io.reset();
+        m_counts.reset();
+    }
+
+    size_t count(const char *key)
+    {
+        std::lock_guard<std::mutex> lock(m_counts->m_lock);
+        counters_base::shm_string k(key, m_counts->m_allocator);
+        auto i = m_counts->m_counter_map->find(k);
+
+        return i == m_counts->m_counter_map->end() ? 0 : i->second;
+    }
+
+    bool wait_count(const char *key, size_t val)
+    {
+        for (size_t i = 0; i < 5000; ++i) {
+            if (count(key) >= val)
+                return true;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return false;
+    }
+
+    /* coded frame without any coefficients set, so it adds no rank */
+    void enc(uint8_t block)
+    {
+        std::vector<uint8_t> data(m_map->payload_size(), 0);
+        struct nlattr *attrs[BATADV_HLP_A_NUM];
+        struct nl_msg *msg = nlmsg_alloc();
+
+        genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->family(), 0, 0,
+                    BATADV_HLP_C_FRAME, 1);
+        nla_put_u8(msg, BATADV_HLP_A_TYPE, ENC_PACKET);
+        nla_put_u16(msg, BATADV_HLP_A_BLOCK, block);
+        nla_put(msg, BATADV_HLP_A_FRAME, data.size(), &data[0]);
+        genlmsg_parse(nlmsg_hdr(msg), 0, attrs, BATADV_HLP_A_MAX, NULL);
+        m_map->add_enc(frame(msg, attrs));
+    }
+
+    void test_tombstone()
+    {
+        open();
+        enc(5);
+        ASSERT_TRUE(wait_count("decoder retired", 1));
+
+        /* late frames of the retired block and older ones are dropped */
+        enc(5);
+        EXPECT_EQ(1, count("decoder tombstone drop"));
+        enc(4);
+        EXPECT_EQ(2, count("decoder tombstone drop"));
+
+        /* a newer block clears the tombstone and gets a decoder */
+        enc(6);
+        EXPECT_EQ(2, count("decoder tombstone drop"));
+        EXPECT_TRUE(wait_count("decoder retired", 2));
+
+        /* and the tombstone now holds the new block */
+        enc(6);
+        EXPECT_EQ(3, count("decoder tombstone drop"));
+        close();
+    }
+};
+
+TEST_F(decoder_map_test, tombstone)
+{
+    test_tombstone();
+}
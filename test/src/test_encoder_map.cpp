@@ -0,0 +1,232 @@
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <netlink/genl/genl.h>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "io.hpp"
+#include "loopback.hpp"
+#include "encoder_map.hpp"
+
+DECLARE_bool(bounce);
+DECLARE_int32(encoders);
+DECLARE_double(encoder_timeout);
+
+/* Loopback without a peer that records the frames io frees */
+class tracking_link : public loopback
+{
+    std::mutex m_lock;
+    std::vector<struct nl_msg *> m_freed;
+
+  public:
+    typedef std::shared_ptr<tracking_link> pointer;
+
+    tracking_link() : loopback(0, 1024)
+    {}
+
+    bool release(struct nl_msg *msg)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_freed.push_back(msg);
+
+        return false;
+    }
+
+    bool freed(struct nl_msg *msg)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        return std::find(m_freed.begin(), m_freed.end(), msg) !=
+               m_freed.end();
+    }
+};
+
+class encoder_map_test : public ::testing::Test {
+    google::FlagSaver m_flags;
+
+  protected:
+    io::pointer m_io;
+    tracking_link::pointer m_link;
+    encoder_map::pointer m_map;
+
+    /* one encoder in one shard, so it is out of encoders after one
+     * generation
+     */
+    void open(int depth, int high, const char *drop)
+    {
+        FLAGS_bounce = false;
+        FLAGS_encoders = 1;
+        FLAGS_encoder_shards = 1;
+        FLAGS_encoder_timeout = 60;
+        FLAGS_stage_depth = depth;
+        FLAGS_stage_high = high;
+        FLAGS_stage_drop = drop;
+
+        m_io = io::pointer(new io);
+        m_link = tracking_link::pointer(new tracking_link);
+        m_io->set_backend(m_link);
+
+        m_map = encoder_map::pointer(new encoder_map);
+        m_map->set_io(m_io);
+        m_map->init(FLAGS_encoders);
+        m_io->set_encoder_map(m_map);
+
+        m_io->netlink_open();
+        m_io->netlink_register();
+        m_io->start();
+    }
+
+    void close()
+    {
+        m_io->stop();
+        m_map.reset();
+        m_io.reset();
+    }
+
+    struct frame plain(size_t i)
+    {
+        static const uint8_t src[ETH_ALEN] = {0x02, 0, 0, 0, 0, 0x01};
+        static const uint8_t dst[ETH_ALEN] = {0x02, 0, 0, 0, 0, 0x02};
+        struct nlattr *attrs[BATADV_HLP_A_NUM];
+        std::vector<uint8_t> data(100, i);
+        struct nl_msg *msg = nlmsg_alloc();
+
+        genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, m_io->family(), 0, 0,
+                    BATADV_HLP_C_FRAME, 1);
+        nla_put_u8(msg, BATADV_HLP_A_TYPE, PLAIN_PACKET);
+        nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, src);
+        nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, dst);
+        nla_put(msg, BATADV_HLP_A_FRAME, data.size(), &data[0]);
+        genlmsg_parse(nlmsg_hdr(msg), 0, attrs, BATADV_HLP_A_MAX, NULL);
+
+        return frame(msg, attrs);
+    }
+
+    /* fill the only encoder, so the frames after it are staged */
+    void exhaust()
+    {
+        for (int i = 0; i < FLAGS_symbols; ++i)
+            m_map->add_plain(plain(i));
+    }
+
+    void ack(uint8_t enc_id, uint8_t block)
+    {
+        struct frame f;
+
+        f.type = ACK_PACKET;
+        f.uid = enc_id << 8 | block;
+        m_map->add_ack(f);
+    }
+
+    bool wait_blocked(bool blocked, size_t ms = 5000)
+    {
+        for (size_t i = 0; i < ms; ++i) {
+            if (m_link->blocked() == blocked)
+                return true;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return false;
+    }
+
+    void test_tail_drop()
+    {
+        std::vector<struct frame> frames;
+
+        open(4, 100, "tail");
+        exhaust();
+
+        for (size_t i = 0; i < 5; ++i) {
+            frames.push_back(plain(i));
+            m_map->add_plain(frames.back());
+        }
+
+        /* the frame that found the buffer full is the one dropped */
+        for (size_t i = 0; i < 4; ++i)
+            EXPECT_FALSE(m_link->freed(frames[i].msg));
+
+        EXPECT_TRUE(m_link->freed(frames[4].msg));
+        close();
+    }
+
+    void test_head_drop()
+    {
+        std::vector<struct frame> frames;
+
+        open(4, 100, "head");
+        exhaust();
+
+        for (size_t i = 0; i < 5; ++i) {
+            frames.push_back(plain(i));
+            m_map->add_plain(frames.back());
+        }
+
+        /* the oldest staged frame makes room for the new one */
+        EXPECT_TRUE(m_link->freed(frames[0].msg));
+
+        for (size_t i = 1; i < 5; ++i)
+            EXPECT_FALSE(m_link->freed(frames[i].msg));
+
+        close();
+    }
+
+    void test_high_watermark()
+    {
+        /* 50% of four frames blocks the kernel at the second one */
+        open(4, 50, "tail");
+        exhaust();
+        m_map->add_plain(plain(0));
+        EXPECT_FALSE(wait_blocked(true, 100));
+
+        m_map->add_plain(plain(1));
+        EXPECT_TRUE(wait_blocked(true));
+        close();
+    }
+
+    void test_drain()
+    {
+        open(4, 50, "tail");
+        exhaust();
+
+        for (size_t i = 0; i < 3; ++i)
+            m_map->add_plain(plain(i));
+
+        ASSERT_TRUE(wait_blocked(true));
+
+        /* the acked encoder is replaced and takes the staged frames */
+        ack(0, 0);
+        EXPECT_TRUE(wait_blocked(false));
+
+        /* with the buffer empty, new frames go to the encoder instead of
+         * filling it up to the watermark again
+         */
+        for (size_t i = 0; i < 3; ++i)
+            m_map->add_plain(plain(i));
+
+        EXPECT_FALSE(wait_blocked(true, 100));
+        close();
+    }
+};
+
+TEST_F(encoder_map_test, tail_drop)
+{
+    test_tail_drop();
+}
+
+TEST_F(encoder_map_test, head_drop)
+{
+    test_head_drop();
+}
+
+TEST_F(encoder_map_test, high_watermark)
+{
+    test_high_watermark();
+}
+
+TEST_F(encoder_map_test, drain)
+{
+    test_drain();
+}
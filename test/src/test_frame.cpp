@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+#include <netlink/genl/genl.h>
+#include <cstring>
+#include "frame.hpp"
+#include "msg_template.hpp"
+
+class frame_test : public ::testing::Test {
+  protected:
+    uint8_t m_src[ETH_ALEN] = {1, 2, 3, 4, 5, 6};
+    uint8_t m_dst[ETH_ALEN] = {6, 5, 4, 3, 2, 1};
+    uint8_t m_data[32];
+
+    void parse(struct nl_msg *msg, struct nlattr **attrs)
+    {
+        struct nlmsghdr *nlh = nlmsg_hdr(msg);
+
+        ASSERT_EQ(0, genlmsg_parse(nlh, 0, attrs, BATADV_HLP_A_MAX, NULL));
+    }
+
+    void test_req()
+    {
+        struct nl_msg *msg = nlmsg_alloc();
+        struct nlattr *attrs[BATADV_HLP_A_NUM];
+
+        genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, 0, 0, 0, 1, 1);
+        nla_put_u8(msg, BATADV_HLP_A_TYPE, REQ_PACKET);
+        nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, m_src);
+        nla_put(msg, BATADV_HLP_A_DST, ETH_ALEN, m_dst);
+        nla_put_u16(msg, BATADV_HLP_A_BLOCK, 0x0102);
+        nla_put_u16(msg, BATADV_HLP_A_RANK, 7);
+        nla_put_u16(msg, BATADV_HLP_A_SEQ, 3);
+        parse(msg, attrs);
+
+        struct frame f(msg, attrs);
+        ASSERT_EQ(msg, f.msg);
+        ASSERT_EQ(REQ_PACKET, f.type);
+        ASSERT_EQ(0x0102, f.uid);
+        ASSERT_EQ(7, f.rank);
+        ASSERT_EQ(3, f.seq);
+        ASSERT_EQ(0, memcmp(m_src, f.src, ETH_ALEN));
+        ASSERT_EQ(0, memcmp(m_dst, f.dst, ETH_ALEN));
+        ASSERT_TRUE(f.data == NULL);
+        ASSERT_EQ(0, f.len);
+
+        nlmsg_free(msg);
+    }
+
+    void test_plain()
+    {
+        struct nl_msg *msg = nlmsg_alloc();
+        struct nlattr *attrs[BATADV_HLP_A_NUM];
+
+        for (size_t i = 0; i < sizeof(m_data); ++i)
+            m_data[i] = i;
+
+        genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, 0, 0, 0, 1, 1);
+        nla_put_u8(msg, BATADV_HLP_A_TYPE, PLAIN_PACKET);
+        nla_put(msg, BATADV_HLP_A_FRAME, sizeof(m_data), m_data);
+        parse(msg, attrs);
+
+        /* payload points into the message instead of being copied */
+        struct frame f(msg, attrs);
+        ASSERT_EQ(PLAIN_PACKET, f.type);
+        ASSERT_EQ(sizeof(m_data), f.len);
+        ASSERT_EQ(0, memcmp(m_data, f.data, sizeof(m_data)));
+        ASSERT_GT(f.data, reinterpret_cast<uint8_t *>(nlmsg_hdr(msg)));
+        ASSERT_TRUE(f.src == NULL);
+
+        nlmsg_free(msg);
+    }
+
+    void test_template()
+    {
+        struct nl_msg *msg = nlmsg_alloc();
+        struct nlattr *attrs[BATADV_HLP_A_NUM];
+        msg_template tmpl;
+        size_t rank, seq;
+
+        genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, 0, 0, 0, 1, 1);
+        nla_put_u8(msg, BATADV_HLP_A_TYPE, REQ_PACKET);
+        nla_put(msg, BATADV_HLP_A_SRC, ETH_ALEN, m_src);
+        nla_put_u16(msg, BATADV_HLP_A_RANK, 0);
+        nla_put_u16(msg, BATADV_HLP_A_SEQ, 0);
+        tmpl.capture(msg);
+        rank = tmpl.offset(BATADV_HLP_A_RANK);
+        seq = tmpl.offset(BATADV_HLP_A_SEQ);
+        nlmsg_free(msg);
+
+        /* stamped messages take patches and further attributes */
+        msg = nlmsg_alloc();
+        tmpl.stamp(msg);
+        msg_template::patch<uint16_t>(msg, rank, 9);
+        msg_template::patch<uint16_t>(msg, seq, 4);
+        nla_put(msg, BATADV_HLP_A_FRAME, sizeof(m_data), m_data);
+        parse(msg, attrs);
+
+        struct frame f(msg, attrs);
+        ASSERT_EQ(REQ_PACKET, f.type);
+        ASSERT_EQ(9, f.rank);
+        ASSERT_EQ(4, f.seq);
+        ASSERT_EQ(0, memcmp(m_src, f.src, ETH_ALEN));
+        ASSERT_EQ(sizeof(m_data), f.len);
+
+        nlmsg_free(msg);
+    }
+
+    void test_flow()
+    {
+        uint8_t pkt[ETH_HLEN + 28] = {0};
+        uint8_t *ip = pkt + ETH_HLEN;
+        struct frame eth, raw;
+        uint32_t h;
+
+        pkt[12] = ETH_P_IP >> 8;
+        pkt[13] = ETH_P_IP & 0xff;
+        ip[0] = 0x45;
+        ip[9] = IPPROTO_UDP;
+        ip[12] = 10;
+        ip[16] = 10;
+        ip[19] = 2;
+        ip[21] = 80;
+
+        eth.data = pkt;
+        eth.len = sizeof(pkt);
+        raw.data = ip;
+        raw.len = sizeof(pkt) - ETH_HLEN;
+
+        /* the same packet with and without an ethernet header */
+        h = eth.flow(true);
+        ASSERT_EQ(h, raw.flow(true));
+        ASSERT_NE(h, eth.flow(false));
+
+        /* ports only count with the tuple and in the first fragment */
+        ip[21] = 81;
+        ASSERT_NE(h, eth.flow(true));
+        ip[7] = 1;
+        h = eth.flow(true);
+        ip[21] = 80;
+        ASSERT_EQ(h, eth.flow(true));
+
+        /* addresses of the frame itself always count */
+        eth.src = m_src;
+        eth.dst = m_dst;
+        ASSERT_NE(raw.flow(false), eth.flow(false));
+    }
+};
+
+TEST_F(frame_test, parse)
+{
+    test_req();
+    test_plain();
+}
+
+TEST_F(frame_test, template)
+{
+    test_template();
+}
+
+TEST_F(frame_test, flow)
+{
+    test_flow();
+}
@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include "io.hpp"
+#include "loopback.hpp"
+#include "encoder_map.hpp"
+#include "decoder_map.hpp"
+
+DECLARE_bool(bounce);
+DECLARE_int32(encoders);
+DECLARE_double(ack_timeout);
+DECLARE_double(req_timeout);
+
+class loopback_test : public ::testing::Test {
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::vector<std::vector<uint8_t> > m_decoded;
+
+    void sink(const uint8_t *data, size_t len)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_decoded.push_back(std::vector<uint8_t>(data, data + len));
+        m_cond.notify_all();
+    }
+
+  protected:
+    io::pointer m_src, m_dst;
+    loopback::pointer m_src_link, m_dst_link;
+    encoder_map::pointer m_enc_map;
+    decoder_map::pointer m_dec_map;
+    ctrl_tracker::pointer m_ack_tracker, m_req_tracker;
+
+    void open(size_t erasure)
+    {
+        FLAGS_bounce = false;
+
+        m_src = io::pointer(new io);
+        m_dst = io::pointer(new io);
+        m_src_link = loopback::pointer(new loopback(erasure, 1024));
+        m_dst_link = loopback::pointer(new loopback(erasure, 1024));
+        loopback::connect(m_src_link, m_dst_link);
+        m_dst_link->set_sink(std::bind(&loopback_test::sink, this,
+                                       std::placeholders::_1,
+                                       std::placeholders::_2));
+        m_src->set_backend(m_src_link);
+        m_dst->set_backend(m_dst_link);
+
+        m_ack_tracker.reset(new ctrl_tracker(FLAGS_ack_timeout*1000));
+        m_req_tracker.reset(new ctrl_tracker(FLAGS_req_timeout*1000));
+
+        m_enc_map = encoder_map::pointer(new encoder_map);
+        m_enc_map->set_io(m_src);
+        m_enc_map->init(FLAGS_encoders);
+        m_src->set_encoder_map(m_enc_map);
+
+        m_dec_map = decoder_map::pointer(new decoder_map);
+        m_dec_map->set_io(m_dst);
+        m_dec_map->ctrl_trackers(ctrl_tracker_api::ACK, m_ack_tracker);
+        m_dec_map->ctrl_trackers(ctrl_tracker_api::REQ, m_req_tracker);
+        m_dst->set_decoder_map(m_dec_map);
+
+        for (auto i : {m_src, m_dst}) {
+            i->netlink_open();
+            i->netlink_register();
+            i->start();
+        }
+    }
+
+    void close()
+    {
+        m_src->stop();
+        m_dst->stop();
+        m_enc_map.reset();
+        m_dec_map.reset();
+        m_src.reset();
+        m_dst.reset();
+    }
+
+    void send(size_t count)
+    {
+        std::vector<uint8_t> data(100);
+
+        for (size_t i = 0; i < count; ++i) {
+            data[0] = i;
+            data[1] = i >> 8;
+
+            while (!m_src_link->inject(&data[0], data.size()))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    size_t wait_decoded(size_t count)
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_cond.wait_for(lock, std::chrono::seconds(5),
+                        [this, count]() { return m_decoded.size() >= count; });
+
+        return m_decoded.size();
+    }
+
+    void test_exchange()
+    {
+        open(0);
+        send(FLAGS_symbols);
+        ASSERT_EQ(FLAGS_symbols, wait_decoded(FLAGS_symbols));
+
+        for (auto &d : m_decoded)
+            ASSERT_EQ(100, d.size());
+
+        close();
+    }
+
+    void test_erasures()
+    {
+        /* coded redundancy and requests make up for the lost frames */
+        open(FLAGS_e3);
+        send(FLAGS_symbols);
+        ASSERT_EQ(FLAGS_symbols, wait_decoded(FLAGS_symbols));
+        close();
+    }
+};
+
+TEST_F(loopback_test, exchange)
+{
+    test_exchange();
+}
+
+TEST_F(loopback_test, erasures)
+{
+    test_erasures();
+}
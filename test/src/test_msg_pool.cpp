@@ -0,0 +1,79 @@
+#include <gtest/gtest.h>
+#include <netlink/genl/genl.h>
+#include "msg_pool.hpp"
+
+class msg_pool_test : public ::testing::Test {
+  protected:
+    size_t m_size = {2048}, m_capacity = {4};
+    msg_pool::pointer m_pool;
+
+    virtual void SetUp()
+    {
+        m_pool = msg_pool::pointer(new msg_pool(m_size, m_capacity));
+    }
+
+    void test_reuse()
+    {
+        msg_pool::cache cache;
+        struct nl_msg *msg, *tmp;
+
+        cache.pool(m_pool);
+        msg = cache.alloc();
+        ASSERT_TRUE(msg != NULL);
+        ASSERT_TRUE(m_pool->fits(msg));
+
+        genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, 0, 0, 0, 1, 1);
+        ASSERT_EQ(0, nla_put_u32(msg, 1, 42));
+        ASSERT_LT(NLMSG_HDRLEN, nlmsg_hdr(msg)->nlmsg_len);
+
+        cache.release(msg);
+        tmp = cache.alloc();
+        ASSERT_EQ(msg, tmp);
+        ASSERT_EQ(NLMSG_HDRLEN, nlmsg_hdr(tmp)->nlmsg_len);
+        cache.release(tmp);
+    }
+
+    void test_foreign()
+    {
+        msg_pool::cache cache;
+        struct nl_msg *msg = nlmsg_alloc_size(m_size / 2);
+
+        cache.pool(m_pool);
+        ASSERT_FALSE(m_pool->fits(msg));
+
+        /* messages of other sizes are freed, not cached */
+        cache.release(msg);
+        msg = cache.alloc();
+        ASSERT_TRUE(m_pool->fits(msg));
+        cache.release(msg);
+    }
+
+    void test_exhaust()
+    {
+        std::vector<struct nl_msg *> msgs;
+        msg_pool::cache cache;
+
+        cache.pool(m_pool);
+
+        /* allocating past the capacity falls back to new messages */
+        for (size_t i = 0; i < 2*m_capacity; ++i)
+            msgs.push_back(cache.alloc());
+
+        for (auto msg : msgs) {
+            ASSERT_TRUE(msg != NULL);
+            ASSERT_TRUE(m_pool->fits(msg));
+            cache.release(msg);
+        }
+    }
+};
+
+TEST_F(msg_pool_test, reuse)
+{
+    test_reuse();
+    test_foreign();
+}
+
+TEST_F(msg_pool_test, exhaust)
+{
+    test_exhaust();
+}
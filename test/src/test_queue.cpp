@@ -118,6 +118,26 @@ class queue_test : public ::testing::Test {
         clear();
     }
 
+    void test_swap()
+    {
+        queue_type batch(m_max_priority);
+        size_t num = 10;
+
+        fill(num);
+        m_queue.swap(batch);
+        ASSERT_TRUE(m_queue.empty());
+        ASSERT_EQ(m_max_priority*num, batch.size());
+        ASSERT_EQ(m_max_priority - 1, batch.priority_next());
+
+        /* the drained batch goes back empty for the next round */
+        batch.clear();
+        m_queue.push(1, 1);
+        m_queue.swap(batch);
+        ASSERT_EQ(0, m_queue.size());
+        ASSERT_EQ(1, batch.size());
+        ASSERT_EQ(1, batch.top());
+    }
+
   public:
     queue_test() : m_queue(m_max_priority)
     {}
@@ -140,4 +160,5 @@ TEST_F(queue_test, order)
 TEST_F(queue_test, api)
 {
     test_next_priority();
+    test_swap();
 }
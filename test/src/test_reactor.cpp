@@ -0,0 +1,211 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "reactor.hpp"
+
+class reactor_test : public ::testing::Test {
+    typedef std::chrono::steady_clock clock;
+
+  protected:
+    reactor::pointer m_reactor;
+
+    virtual void SetUp()
+    {
+        m_reactor = reactor::pointer(new reactor(2));
+        m_reactor->start();
+    }
+
+    virtual void TearDown()
+    {
+        m_reactor->stop();
+    }
+
+    template<typename func>
+    bool wait_for(func cond)
+    {
+        clock::time_point end = clock::now() + std::chrono::seconds(2);
+
+        while (!cond() && clock::now() < end)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+        return cond();
+    }
+
+    void test_event()
+    {
+        std::atomic<size_t> count = {0};
+        int fd = m_reactor->add_event([&count]() { count++; });
+
+        m_reactor->notify(fd);
+        ASSERT_TRUE(wait_for([&count]() { return count == 1; }));
+
+        /* notifications before the callback runs are coalesced */
+        m_reactor->notify(fd);
+        m_reactor->notify(fd);
+        ASSERT_TRUE(wait_for([&count]() { return count >= 2; }));
+
+        m_reactor->remove(fd);
+    }
+
+    void test_timer()
+    {
+        std::atomic<bool> fired = {false};
+        clock::time_point start, stop;
+        int fd;
+
+        fd = m_reactor->add_timer([&fired, &stop]() {
+            stop = clock::now();
+            fired = true;
+        });
+
+        start = clock::now();
+        m_reactor->arm(fd, std::chrono::milliseconds(5));
+        ASSERT_TRUE(wait_for([&fired]() { return fired.load(); }));
+        ASSERT_GE(stop - start, std::chrono::milliseconds(5));
+
+        /* a disarmed timer stays quiet */
+        fired = false;
+        m_reactor->arm(fd, std::chrono::milliseconds(5));
+        m_reactor->disarm(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ASSERT_FALSE(fired);
+
+        m_reactor->remove(fd);
+    }
+
+    void test_remove()
+    {
+        std::atomic<bool> running = {false}, done = {false};
+        int fd;
+
+        fd = m_reactor->add_event([&running, &done]() {
+            running = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            done = true;
+        });
+
+        m_reactor->notify(fd);
+        ASSERT_TRUE(wait_for([&running]() { return running.load(); }));
+
+        /* remove waits for the callback in progress */
+        m_reactor->remove(fd);
+        ASSERT_TRUE(done);
+    }
+
+    void test_spread()
+    {
+        std::atomic<size_t> active = {0}, peak = {0}, count = {0};
+        std::vector<int> fds;
+
+        for (size_t i = 0; i < 8; ++i)
+            fds.push_back(m_reactor->add_event([&]() {
+                size_t a = ++active, p = peak;
+
+                while (a > p && !peak.compare_exchange_weak(p, a))
+                    ;
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                active--;
+                count++;
+            }));
+
+        /* a burst picked up by one thread is shared with the idle one */
+        for (auto fd : fds)
+            m_reactor->notify(fd);
+
+        ASSERT_TRUE(wait_for([&count]() { return count == 8; }));
+        ASSERT_EQ(2, peak.load());
+
+        for (auto fd : fds)
+            m_reactor->remove(fd);
+    }
+
+    void test_group()
+    {
+        reactor r(2);
+        std::atomic<int> cpu = {-1};
+        cpu_set_t set;
+        size_t grp;
+        int fd;
+
+        reactor::parse_cpus("0-2,5", &set);
+        ASSERT_EQ(4, CPU_COUNT(&set));
+        ASSERT_TRUE(CPU_ISSET(5, &set));
+
+        /* unpinned coders share group 0, pinned ones know their node */
+        ASSERT_EQ(0, r.coder_group());
+        ASSERT_EQ(0, r.coder_group());
+        ASSERT_EQ(2, r.coder_threads());
+        ASSERT_EQ(-1, r.node(0));
+        ASSERT_EQ(reactor::cpu_node(0), reactor(1, "0").node(0));
+
+        /* callbacks of a pinned group run on its CPUs only */
+        grp = r.add_group("pinned", 1, "0");
+        fd = r.add_event([&cpu]() { cpu = sched_getcpu(); }, grp);
+        r.start();
+        r.notify(fd);
+        ASSERT_TRUE(wait_for([&cpu]() { return cpu >= 0; }));
+        ASSERT_EQ(0, cpu);
+
+        r.remove(fd);
+        r.stop();
+    }
+
+    void test_inline()
+    {
+        reactor r(1);
+        std::atomic<bool> a_done = {false}, b_after = {false};
+        std::atomic<size_t> count = {0};
+        int a, b;
+
+        /* b runs right after a on the same thread, not nested inside it */
+        r.run_inline(true);
+        b = r.add_event([&]() { b_after = a_done.load(); count++; });
+        a = r.add_event([&]() { r.notify(b); r.notify(b); a_done = true; });
+        r.start();
+
+        r.notify(a);
+        ASSERT_TRUE(wait_for([&count]() { return count >= 1; }));
+        ASSERT_TRUE(b_after);
+
+        /* notifications queued before the callback runs are coalesced */
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ASSERT_EQ(1, count);
+
+        r.remove(a);
+        r.remove(b);
+        r.stop();
+    }
+};
+
+TEST_F(reactor_test, event)
+{
+    test_event();
+}
+
+TEST_F(reactor_test, timer)
+{
+    test_timer();
+}
+
+TEST_F(reactor_test, remove)
+{
+    test_remove();
+}
+
+TEST_F(reactor_test, spread)
+{
+    test_spread();
+}
+
+TEST_F(reactor_test, group)
+{
+    test_group();
+}
+
+TEST_F(reactor_test, inline)
+{
+    test_inline();
+}
@@ -0,0 +1,104 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+#include "ring_queue.hpp"
+
+class ring_queue_test : public ::testing::Test {
+  protected:
+    void test_full()
+    {
+        ring_queue<int> queue(4);
+        int val;
+
+        for (int i = 0; i < 4; ++i)
+            ASSERT_TRUE(queue.push(i));
+
+        ASSERT_FALSE(queue.push(4));
+        ASSERT_EQ(4, queue.size());
+
+        for (int i = 0; i < 4; ++i) {
+            ASSERT_TRUE(queue.pop(val));
+            ASSERT_EQ(i, val);
+        }
+
+        ASSERT_FALSE(queue.pop(val));
+        ASSERT_TRUE(queue.empty());
+    }
+
+    void test_prio()
+    {
+        prio_ring_queue<int> queue(4, 16);
+        std::vector<int> priorities = {0,1,2,3,2,1,0,1,2,0};
+        int val, last = 3;
+
+        for (auto i : priorities)
+            ASSERT_TRUE(queue.push(i, i));
+
+        ASSERT_EQ(priorities.size(), queue.size());
+
+        while (queue.pop(val)) {
+            ASSERT_LE(val, last);
+            last = val;
+        }
+
+        ASSERT_TRUE(queue.empty());
+
+        /* a single lane can be drained regardless of the others */
+        for (auto i : priorities)
+            ASSERT_TRUE(queue.push(i, i));
+
+        ASSERT_TRUE(queue.pop_lane(3, val));
+        ASSERT_EQ(3, val);
+        ASSERT_FALSE(queue.pop_lane(3, val));
+        ASSERT_TRUE(queue.pop_lane(0, val));
+        ASSERT_EQ(0, val);
+        ASSERT_EQ(priorities.size() - 2, queue.size());
+
+        while (queue.pop(val));
+    }
+
+    void test_producers()
+    {
+        size_t producers = 4, num = 10000, count = 0;
+        prio_ring_queue<size_t> queue(2, 64);
+        std::vector<size_t> last(producers, 0);
+        std::vector<std::thread> threads;
+        size_t val;
+
+        for (size_t p = 0; p < producers; ++p) {
+            threads.push_back(std::thread([&queue, p, num]() {
+                for (size_t i = 1; i <= num; ++i)
+                    while (!queue.push(p % 2, p*num + i))
+                        std::this_thread::yield();
+            }));
+        }
+
+        /* values from one producer must come out in the order pushed */
+        while (count < producers*num) {
+            if (!queue.pop(val)) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            ASSERT_GT(val - (val - 1)/num*num, last[(val - 1)/num]);
+            last[(val - 1)/num] = val - (val - 1)/num*num;
+            count++;
+        }
+
+        for (auto &t : threads)
+            t.join();
+
+        ASSERT_TRUE(queue.empty());
+    }
+};
+
+TEST_F(ring_queue_test, order)
+{
+    test_full();
+    test_prio();
+}
+
+TEST_F(ring_queue_test, producers)
+{
+    test_producers();
+}
@@ -0,0 +1,96 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "timer_wheel.hpp"
+
+class timer_wheel_test : public ::testing::Test {
+    typedef std::chrono::steady_clock clock;
+
+  protected:
+    reactor::pointer m_reactor;
+    timer_wheel::pointer m_wheel;
+
+    virtual void SetUp()
+    {
+        m_reactor = reactor::pointer(new reactor(2));
+        m_wheel = timer_wheel::pointer(new timer_wheel(m_reactor));
+        m_reactor->start();
+    }
+
+    virtual void TearDown()
+    {
+        m_reactor->stop();
+        m_wheel.reset();
+    }
+
+    template<typename func>
+    bool wait_for(func cond)
+    {
+        clock::time_point end = clock::now() + std::chrono::seconds(2);
+
+        while (!cond() && clock::now() < end)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+        return cond();
+    }
+
+    void test_expire()
+    {
+        timer_wheel::entry near, far;
+        std::atomic<size_t> count = {0};
+        clock::time_point start, near_stop, far_stop;
+
+        near.set_callback([&]() { near_stop = clock::now(); count++; });
+        far.set_callback([&]() { far_stop = clock::now(); count++; });
+
+        /* the far one sits on the second level until it cascades */
+        start = clock::now();
+        m_wheel->add(far, std::chrono::milliseconds(150));
+        m_wheel->add(near, std::chrono::milliseconds(5));
+        ASSERT_EQ(2, m_wheel->pending());
+
+        ASSERT_TRUE(wait_for([&count]() { return count == 2; }));
+        ASSERT_TRUE(near.expired());
+        ASSERT_TRUE(far.expired());
+        ASSERT_FALSE(far.expired());
+        ASSERT_GE(near_stop - start, std::chrono::milliseconds(5));
+        ASSERT_GE(far_stop - start, std::chrono::milliseconds(150));
+        ASSERT_LT(far_stop - start, std::chrono::milliseconds(300));
+        ASSERT_EQ(0, m_wheel->pending());
+    }
+
+    void test_cancel()
+    {
+        timer_wheel::entry e, other;
+        std::atomic<size_t> count = {0};
+
+        e.set_callback([&count]() { count++; });
+        other.set_callback([&count]() { count++; });
+
+        m_wheel->add(e, std::chrono::milliseconds(5));
+        m_wheel->add(other, std::chrono::milliseconds(10));
+        m_wheel->cancel(e);
+        ASSERT_EQ(1, m_wheel->pending());
+
+        /* adding again moves the deadline instead of adding a timer */
+        m_wheel->add(other, std::chrono::milliseconds(20));
+        ASSERT_EQ(1, m_wheel->pending());
+
+        ASSERT_TRUE(wait_for([&count]() { return count == 1; }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ASSERT_EQ(1, count);
+        ASSERT_FALSE(e.expired());
+        ASSERT_TRUE(other.expired());
+    }
+};
+
+TEST_F(timer_wheel_test, expire)
+{
+    test_expire();
+}
+
+TEST_F(timer_wheel_test, cancel)
+{
+    test_cancel();
+}